@@ -0,0 +1,190 @@
+// Benchmarks of the hot paths of the Mapnik C API, driven by the sample
+// stylesheet. Build with build.bash, then run from this directory with
+//
+//     ./capi_bench [sampledata dir] [seconds per benchmark]
+
+#include "mapnik_c_api.h"
+#include "png_reader.h"
+
+#include <mapnik/image.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static double min_seconds = 1.0;
+
+// Runs f with growing iteration counts until it takes at least min_seconds
+// and prints the time per iteration.
+static void run(string const& name, function<void(int)> const& f) {
+    for (int n = 1; ; n *= 2) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        f(n);
+        double s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (s >= min_seconds || n >= (1 << 30)) {
+            printf("%-32s %10d %14.0f ns/op\n", name.c_str(), n, s * 1e9 / n);
+            return;
+        }
+    }
+}
+
+static void check(int ret, mapnik_map_t * m, char const* what) {
+    if (ret != 0) {
+        fprintf(stderr, "%s: %s\n", what, mapnik_map_last_error(m));
+        exit(1);
+    }
+}
+
+static mapnik_map_t * load(string const& stylesheet) {
+    mapnik_map_t * m = mapnik_map(256, 256);
+    check(mapnik_map_load(m, stylesheet.c_str()), m, "load");
+    return m;
+}
+
+static const double lon = 10.0, lat = 50.0;
+
+// Web Mercator tile containing lon/lat at zoom level z
+static void tile_at(unsigned z, unsigned & x, unsigned & y) {
+    double n = ldexp(1.0, z);
+    double r = lat * M_PI / 180.0;
+    x = (unsigned) ((lon + 180.0) / 360.0 * n);
+    y = (unsigned) ((1.0 - log(tan(r) + 1.0 / cos(r)) / M_PI) / 2.0 * n);
+}
+
+static string read_file(string const& path) {
+    ifstream in(path.c_str(), ios_base::binary);
+    stringstream s;
+    s << in.rdbuf();
+    return s.str();
+}
+
+int main(int argc, char ** argv) {
+    string sampledata = argc > 1 ? argv[1] : "../../sampledata";
+    if (argc > 2) {
+        min_seconds = atof(argv[2]);
+    }
+    string stylesheet = sampledata + "/stylesheet.xml";
+    char * err = NULL;
+    if (mapnik_register_datasources(PLUGIN_PATH, &err) != 0) {
+        fprintf(stderr, "register datasources: %s\n", err ? err : "");
+        return 1;
+    }
+    printf("Mapnik %s\n", mapnik_version_string());
+
+    run("MapLoad", [&](int n) {
+        for (int i = 0; i < n; i++) {
+            mapnik_map_free(load(stylesheet));
+        }
+    });
+
+    mapnik_map_t * m = load(stylesheet);
+    mapnik_layer_t * world = mapnik_map_get_layer(m, 0);
+
+    mapnik_projection_t * p = mapnik_map_projection(m);
+    run("ProjectionForward", [&](int n) {
+        mapnik_coord_t c = { lon, lat };
+        for (int i = 0; i < n; i++) {
+            c = mapnik_projection_forward(p, c);
+            c.x = lon;
+            c.y = lat;
+        }
+    });
+    vector<mapnik_coord_t> coords(1024);
+    run("ProjectionForwardMany1024", [&](int n) {
+        for (int i = 0; i < n; i++) {
+            for (size_t k = 0; k < coords.size(); k++) {
+                coords[k].x = lon;
+                coords[k].y = lat;
+            }
+            mapnik_projection_forward_many(p, coords.data(), coords.size());
+        }
+    });
+    mapnik_projection_free(p);
+
+    unsigned const zooms[] = { 2, 5, 8, 11 };
+    string png;
+    for (unsigned z : zooms) {
+        unsigned x, y;
+        tile_at(z, x, y);
+        check(mapnik_map_zoom_to_tile(m, z, x, y, 256, 128), m, "zoom");
+        string suffix = "/z" + to_string(z);
+
+        run("RenderToImage" + suffix, [&](int n) {
+            for (int i = 0; i < n; i++) {
+                mapnik_image_free(mapnik_map_render_to_image(m));
+            }
+        });
+        mapnik_image_t * im = mapnik_map_render_to_image(m);
+        run("RenderInto" + suffix, [&](int n) {
+            for (int i = 0; i < n; i++) {
+                check(mapnik_map_render_into(m, im), m, "render");
+            }
+        });
+        run("ImageToPngBlob" + suffix, [&](int n) {
+            for (int i = 0; i < n; i++) {
+                mapnik_blob_free(mapnik_image_to_png_blob(im));
+            }
+        });
+        mapnik_blob_t * blob = mapnik_image_to_png_blob(im);
+        png.assign(blob->ptr, blob->len);
+        mapnik_blob_free(blob);
+        mapnik_image_free(im);
+
+        run("RenderToGridToJson" + suffix, [&](int n) {
+            for (int i = 0; i < n; i++) {
+                mapnik_grid_t * g = mapnik_map_render_to_grid(m, world, "ISO2");
+                free(mapnik_grid_to_json(g, 4, NULL));
+                mapnik_grid_free(g);
+            }
+        });
+    }
+
+    // PNG reader on a larger rendering of the map, read from memory and from
+    // a file, as a whole and in windows
+    mapnik_map_resize(m, 1024, 1024);
+    check(mapnik_map_zoom_to_tile(m, 3, 4, 2, 1024, 0), m, "zoom");
+    string path = "capi_bench.png";
+    check(mapnik_map_render_to_file(m, path.c_str()), m, "render to file");
+    png = read_file(path);
+    unique_ptr<mapnik::image_reader> r(png_reader_for_bytes(png.data(), png.size()));
+    unsigned w = r->width(), h = r->height();
+
+    run("PngReadBytes", [&](int n) {
+        for (int i = 0; i < n; i++) {
+            unique_ptr<mapnik::image_reader> reader(png_reader_for_bytes(png.data(), png.size()));
+            mapnik::image_rgba8 image(w, h);
+            reader->read(0, 0, image);
+        }
+    });
+    run("PngReadFile", [&](int n) {
+        for (int i = 0; i < n; i++) {
+            unique_ptr<mapnik::image_reader> reader(png_reader_for_file(path));
+            mapnik::image_rgba8 image(w, h);
+            reader->read(0, 0, image);
+        }
+    });
+    run("PngReadWindows256", [&](int n) {
+        mapnik::image_rgba8 image(256, 256);
+        for (int i = 0; i < n; i++) {
+            for (unsigned y = 0; y + 256 <= h; y += 256) {
+                for (unsigned x = 0; x + 256 <= w; x += 256) {
+                    r->read(x, y, image);
+                }
+            }
+        }
+    });
+    remove(path.c_str());
+
+    mapnik_layer_free(world);
+    mapnik_map_free(m);
+    return 0;
+}
@@ -0,0 +1,12 @@
+#!/bin/bash
+# Builds capi_bench against the installed Mapnik, like mapnik/configure.bash
+# does for the Go bindings.
+
+cd "$(dirname "$0")"
+SRC=../../mapnik
+
+${CXX:-c++} -O2 -std=c++11 -DHAVE_PNG \
+    -DPLUGIN_PATH="\"$(mapnik-config --input-plugins)\"" \
+    $(mapnik-config --cflags) -I$SRC \
+    -o capi_bench bench.cpp $SRC/mapnik_c_api.cpp $SRC/png_reader.cpp \
+    $(mapnik-config --libs) $(mapnik-config --dep-libs) -lpng -lz
@@ -0,0 +1,229 @@
+package main
+
+// Load test of the tile serving path. Runs a TileServer for the sample
+// stylesheet in-process with a temporary cache db and requests tiles from it
+// over HTTP, first with empty caches (cold) and then the same requests again
+// (warm). Run from the repository root with
+//
+//	go run loadtest/main.go [-requests 2000] [-concurrency 8] [-log access.log]
+
+import (
+	"bufio"
+	"flag"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"math/rand"
+	"net/http"
+	"net/http/httptest"
+	"os"
+	"path/filepath"
+	"regexp"
+	"runtime"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/fawick/go-mapnik/maptiles"
+)
+
+var tilePath = regexp.MustCompile(`/[A-Za-z0-9]+/([0-9]+)/([0-9]+)/([0-9]+)\.(?:png|jpe?g|webp)`)
+
+// Returns n tile paths with zoom levels drawn according to weights, where
+// weights[z] is the relative share of requests for zoom level z. Within a
+// zoom level, requests concentrate on a few hot spots the way map viewers
+// cluster around populated areas.
+func zoomWeighted(n int, weights []float64, rnd *rand.Rand) []string {
+	var total float64
+	for _, w := range weights {
+		total += w
+	}
+	hotspots := [][2]float64{{0.52, 0.33}, {0.28, 0.38}, {0.85, 0.40}, {0.30, 0.58}}
+	paths := make([]string, n)
+	for i := range paths {
+		r := rnd.Float64() * total
+		z := 0
+		for z < len(weights)-1 && r >= weights[z] {
+			r -= weights[z]
+			z++
+		}
+		size := 1 << uint(z)
+		h := hotspots[rnd.Intn(len(hotspots))]
+		// spread of about 8 tiles around the hot spot at every zoom level
+		x := clamp(int(h[0]*float64(size)+rnd.NormFloat64()*4), size)
+		y := clamp(int(h[1]*float64(size)+rnd.NormFloat64()*4), size)
+		paths[i] = fmt.Sprintf("/default/%d/%d/%d.png", z, x, y)
+	}
+	return paths
+}
+
+func clamp(v, size int) int {
+	if v < 0 {
+		return 0
+	}
+	if v >= size {
+		return size - 1
+	}
+	return v
+}
+
+// Returns the tile requests found in an access log, one per line, for the
+// default layer.
+func replay(r io.Reader) ([]string, error) {
+	var paths []string
+	s := bufio.NewScanner(r)
+	for s.Scan() {
+		m := tilePath.FindStringSubmatch(s.Text())
+		if m != nil {
+			paths = append(paths, fmt.Sprintf("/default/%s/%s/%s.png", m[1], m[2], m[3]))
+		}
+	}
+	return paths, s.Err()
+}
+
+type result struct {
+	latencies []time.Duration
+	elapsed   time.Duration
+	errors    int
+	bytes     int64
+}
+
+// Requests all paths from base with the given number of concurrent clients.
+func run(base string, paths []string, concurrency int) result {
+	client := &http.Client{Transport: &http.Transport{MaxIdleConnsPerHost: concurrency}}
+	res := result{latencies: make([]time.Duration, len(paths))}
+	var mu sync.Mutex
+	var wg sync.WaitGroup
+	next := make(chan int)
+	start := time.Now()
+	for c := 0; c < concurrency; c++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for i := range next {
+				t := time.Now()
+				resp, err := client.Get(base + paths[i])
+				var n int64
+				if err == nil {
+					n, err = io.Copy(ioutil.Discard, resp.Body)
+					resp.Body.Close()
+					if err == nil && resp.StatusCode != http.StatusOK {
+						err = fmt.Errorf("%s: %s", paths[i], resp.Status)
+					}
+				}
+				res.latencies[i] = time.Since(t)
+				mu.Lock()
+				res.bytes += n
+				if err != nil {
+					res.errors++
+				}
+				mu.Unlock()
+			}
+		}()
+	}
+	for i := range paths {
+		next <- i
+	}
+	close(next)
+	wg.Wait()
+	res.elapsed = time.Since(start)
+	return res
+}
+
+func percentile(sorted []time.Duration, p float64) time.Duration {
+	if len(sorted) == 0 {
+		return 0
+	}
+	return sorted[int(p*float64(len(sorted)-1))]
+}
+
+func (r result) report(name string) {
+	sorted := append([]time.Duration(nil), r.latencies...)
+	sort.Slice(sorted, func(i, j int) bool { return sorted[i] < sorted[j] })
+	fmt.Printf("%-5s %6d requests in %8.2fs  %8.1f req/s  %7.1f MB  %d errors\n",
+		name, len(sorted), r.elapsed.Seconds(), float64(len(sorted))/r.elapsed.Seconds(),
+		float64(r.bytes)/(1<<20), r.errors)
+	fmt.Printf("      p50 %v  p90 %v  p99 %v  max %v\n",
+		percentile(sorted, .5), percentile(sorted, .9), percentile(sorted, .99), percentile(sorted, 1))
+}
+
+func parseWeights(s string) ([]float64, error) {
+	var weights []float64
+	for _, f := range strings.Split(s, ",") {
+		w, err := strconv.ParseFloat(strings.TrimSpace(f), 64)
+		if err != nil {
+			return nil, err
+		}
+		weights = append(weights, w)
+	}
+	return weights, nil
+}
+
+func main() {
+	sampledata := flag.String("sampledata", "sampledata", "directory of the sample stylesheet and shapefile")
+	requests := flag.Int("requests", 2000, "number of zoom-weighted requests per pass")
+	weights := flag.String("zoomweights", "1,2,4,8,10,10,8,6,4,2", "relative share of requests per zoom level, starting at zoom 0")
+	concurrency := flag.Int("concurrency", 2*runtime.NumCPU(), "concurrent clients")
+	logFile := flag.String("log", "", "replay the tile requests of this access log instead")
+	seed := flag.Int64("seed", 1, "seed of the request distribution")
+	memCache := flag.Bool("memcache", true, "serve warm tiles from the in-memory cache, otherwise from the cache db")
+	flag.Parse()
+
+	var paths []string
+	if *logFile != "" {
+		f, err := os.Open(*logFile)
+		if err != nil {
+			fmt.Fprintln(os.Stderr, err)
+			os.Exit(1)
+		}
+		paths, err = replay(f)
+		f.Close()
+		if err != nil {
+			fmt.Fprintln(os.Stderr, err)
+			os.Exit(1)
+		}
+	} else {
+		w, err := parseWeights(*weights)
+		if err != nil {
+			fmt.Fprintln(os.Stderr, "invalid zoom weights:", err)
+			os.Exit(1)
+		}
+		paths = zoomWeighted(*requests, w, rand.New(rand.NewSource(*seed)))
+	}
+
+	dir, err := ioutil.TempDir("", "maptiles-loadtest")
+	if err != nil {
+		fmt.Fprintln(os.Stderr, err)
+		os.Exit(1)
+	}
+	defer os.RemoveAll(dir)
+	stylesheet, err := filepath.Abs(filepath.Join(*sampledata, "stylesheet.xml"))
+	if err != nil {
+		fmt.Fprintln(os.Stderr, err)
+		os.Exit(1)
+	}
+
+	t := maptiles.NewTileServer(filepath.Join(dir, "cache.mbtiles"))
+	t.AddMapnikLayer("default", stylesheet)
+	if !*memCache {
+		t.MemCache = nil
+	}
+	s := httptest.NewServer(t)
+	defer s.Close()
+
+	fmt.Printf("%d requests, %d distinct tiles, %d clients\n", len(paths), distinct(paths), *concurrency)
+	run(s.URL, paths, *concurrency).report("cold")
+	// give the batched inserts of the cold pass time to reach the cache db
+	time.Sleep(time.Second)
+	run(s.URL, paths, *concurrency).report("warm")
+}
+
+func distinct(paths []string) int {
+	seen := make(map[string]bool, len(paths))
+	for _, p := range paths {
+		seen[p] = true
+	}
+	return len(seen)
+}
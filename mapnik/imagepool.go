@@ -0,0 +1,61 @@
+package mapnik
+
+import "sync"
+
+// Bytes of pixel data kept by DefaultImagePool
+const DefaultImagePoolBytes = 64 << 20
+
+// Image pool shared by all maps of this package
+var DefaultImagePool = NewImagePool(DefaultImagePoolBytes)
+
+// ImagePool keeps released images for reuse by later renders of the same
+// size. Each map keeps the image it renders into and only exchanges it with
+// the pool when the size changes, e.g. between tiles and metatiles, or when
+// it is freed. Released images beyond maxBytes of pixel data are freed.
+// Safe for concurrent use.
+type ImagePool struct {
+	mu       sync.Mutex
+	maxBytes int
+	bytes    int
+	free     map[[2]uint32][]*Image
+}
+
+func NewImagePool(maxBytes int) *ImagePool {
+	return &ImagePool{maxBytes: maxBytes, free: make(map[[2]uint32][]*Image)}
+}
+
+func imageBytes(width, height uint32) int {
+	return int(width) * int(height) * 4
+}
+
+// Get returns an image of the given size, either a released one or a new one.
+// Its pixels are undefined until it is rendered into.
+func (p *ImagePool) Get(width, height uint32) *Image {
+	key := [2]uint32{width, height}
+	p.mu.Lock()
+	if l := p.free[key]; len(l) > 0 {
+		i := l[len(l)-1]
+		l[len(l)-1] = nil
+		p.free[key] = l[:len(l)-1]
+		p.bytes -= imageBytes(width, height)
+		p.mu.Unlock()
+		return i
+	}
+	p.mu.Unlock()
+	return NewImage(width, height)
+}
+
+// Put releases i back into the pool. i must not be used afterwards.
+func (p *ImagePool) Put(i *Image) {
+	key := [2]uint32{i.width, i.height}
+	size := imageBytes(i.width, i.height)
+	p.mu.Lock()
+	if p.bytes+size <= p.maxBytes {
+		p.free[key] = append(p.free[key], i)
+		p.bytes += size
+		p.mu.Unlock()
+		return
+	}
+	p.mu.Unlock()
+	i.Free()
+}
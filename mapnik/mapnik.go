@@ -7,6 +7,7 @@ import "C"
 import (
 	"errors"
 	"fmt"
+	"time"
 	"unsafe"
 )
 
@@ -36,6 +37,30 @@ func RegisterFonts(path string) {
 	C.mapnik_register_fonts(cs, &err)
 }
 
+// Counters of the process-wide cache of decoded PNG images, which holds the
+// PNG files that maps read.
+type ImageCacheStats struct {
+	Hits, Misses  uint64
+	Bytes, Images int
+	MaxBytes      int
+}
+
+func ImageCache() ImageCacheStats {
+	s := C.mapnik_image_cache_stats()
+	return ImageCacheStats{
+		Hits:     uint64(s.hits),
+		Misses:   uint64(s.misses),
+		Bytes:    int(s.bytes),
+		Images:   int(s.images),
+		MaxBytes: int(s.max_bytes),
+	}
+}
+
+// Limits the decoded image cache to maxBytes, 0 disables it.
+func SetImageCacheSize(maxBytes int) {
+	C.mapnik_image_cache_set_max_bytes(C.size_t(maxBytes))
+}
+
 // Point in 2D space
 type Coord struct {
 	X, Y float64
@@ -57,6 +82,22 @@ func (p Projection) Forward(coord Coord) Coord {
 	return Coord{float64(c.x), float64(c.y)}
 }
 
+// ForwardMany transforms all coordinates in place like Forward, but with a
+// single call for the whole slice.
+func (p Projection) ForwardMany(coords []Coord) {
+	if len(coords) > 0 {
+		C.mapnik_projection_forward_many(p.p, (*C.mapnik_coord_t)(unsafe.Pointer(&coords[0])), C.size_t(len(coords)))
+	}
+}
+
+// InverseMany transforms all coordinates in place from the projection back to
+// longitude/latitude.
+func (p Projection) InverseMany(coords []Coord) {
+	if len(coords) > 0 {
+		C.mapnik_projection_inverse_many(p.p, (*C.mapnik_coord_t)(unsafe.Pointer(&coords[0])), C.size_t(len(coords)))
+	}
+}
+
 // Layer data source
 type Datasource struct {
 	ds *C.struct__mapnik_datasource_t
@@ -110,11 +151,20 @@ func (l *Layer) SetDatasource(ds *Datasource) {
 
 // Map base type
 type Map struct {
-	m *C.struct__mapnik_map_t
+	m       *C.struct__mapnik_map_t
+	scratch []byte // encoding buffer of RenderToMemorySolid, reused across renders
+	img     *Image // image rendered into, reused across renders of the same size
 }
 
 func NewMap(width, height uint32) *Map {
-	return &Map{C.mapnik_map(C.uint(width), C.uint(height))}
+	return &Map{m: C.mapnik_map(C.uint(width), C.uint(height))}
+}
+
+// Clone returns an independent copy of the map that shares its datasources
+// with m. Cloning a loaded map is much cheaper than loading the stylesheet
+// again, and clones may be rendered concurrently.
+func (m *Map) Clone() *Map {
+	return &Map{m: C.mapnik_map_clone(m.m)}
 }
 
 func (m *Map) lastError() error {
@@ -146,9 +196,34 @@ func (m *Map) Resize(width, height uint32) {
 	C.mapnik_map_resize(m.m, C.uint(width), C.uint(height))
 }
 
+func (m *Map) Width() uint32 {
+	return uint32(C.mapnik_map_width(m.m))
+}
+
+func (m *Map) Height() uint32 {
+	return uint32(C.mapnik_map_height(m.m))
+}
+
 func (m *Map) Free() {
 	C.mapnik_map_free(m.m)
 	m.m = nil
+	if m.img != nil {
+		DefaultImagePool.Put(m.img)
+		m.img = nil
+	}
+}
+
+// Returns the map's image to render into at the given size. An image of
+// another size is exchanged through DefaultImagePool.
+func (m *Map) image(width, height uint32) *Image {
+	if m.img != nil && (m.img.width != width || m.img.height != height) {
+		DefaultImagePool.Put(m.img)
+		m.img = nil
+	}
+	if m.img == nil {
+		m.img = DefaultImagePool.Get(width, height)
+	}
+	return m.img
 }
 
 func (m *Map) SRS() string {
@@ -174,6 +249,69 @@ func (m *Map) ZoomToMinMax(minx, miny, maxx, maxy float64) {
 	C.mapnik_map_zoom_to_box(m.m, bbox)
 }
 
+// ZoomToTile resizes the map to tileSize and zooms to the Web Mercator tile
+// x/y at the given zoom level with a buffer of bufferSize pixels around it.
+// The tile extent is computed natively with a cached transform.
+func (m *Map) ZoomToTile(zoom, x, y uint64, tileSize uint32, bufferSize int) error {
+	if C.mapnik_map_zoom_to_tile(m.m, C.uint(zoom), C.uint(x), C.uint(y), C.uint(tileSize), C.int(bufferSize)) != 0 {
+		return m.lastError()
+	}
+	return nil
+}
+
+// Statistics of a single layer of a render
+type LayerStats struct {
+	Name string
+	// Time spent reading and rendering the layer's features
+	Duration time.Duration
+	Features uint64
+}
+
+// Statistics of a render and of encoding the rendered image, see
+// Map.SetRenderStats
+type RenderStats struct {
+	Render       time.Duration
+	Encode       time.Duration
+	EncodedBytes int
+	Layers       []LayerStats
+}
+
+// SetRenderStats enables or disables collecting statistics for each render,
+// see RenderStats. Collecting them adds a small overhead per feature.
+func (m *Map) SetRenderStats(enabled bool) {
+	e := C.int(0)
+	if enabled {
+		e = 1
+	}
+	C.mapnik_map_set_render_stats(m.m, e)
+}
+
+// RenderStats returns the statistics of the last render of the map and of
+// encoding its image, or nil if they are not enabled.
+func (m *Map) RenderStats() *RenderStats {
+	s := C.mapnik_map_render_stats(m.m)
+	if s == nil {
+		return nil
+	}
+	rs := &RenderStats{
+		Render:       seconds(s.render_seconds),
+		Encode:       seconds(s.encode_seconds),
+		EncodedBytes: int(s.encoded_bytes),
+		Layers:       make([]LayerStats, int(s.layer_count)),
+	}
+	if len(rs.Layers) > 0 {
+		layers := (*[1 << 20]C.mapnik_layer_stats_t)(unsafe.Pointer(s.layers))[:len(rs.Layers):len(rs.Layers)]
+		for i, l := range layers {
+			rs.Layers[i] = LayerStats{C.GoString(l.name), seconds(l.seconds), uint64(l.features)}
+		}
+	}
+	return rs
+}
+
+func seconds(s C.double) time.Duration {
+	return time.Duration(float64(s) * float64(time.Second))
+}
+
 func (m *Map) RenderToFile(path string) error {
 	cs := C.CString(path)
 	defer C.free(unsafe.Pointer(cs))
@@ -183,15 +321,174 @@ func (m *Map) RenderToFile(path string) error {
 	return nil
 }
 
+const minEncodeBuffer = 4096
+
 func (m *Map) RenderToMemoryPng() ([]byte, error) {
-	i := C.mapnik_map_render_to_image(m.m)
-	if i == nil {
-		return nil, m.lastError()
+	return m.RenderToMemory("png256")
+}
+
+// RenderToMemory renders the map and returns the image encoded in format,
+// which is any Mapnik format string like "png256", "png8:z=1", "png32",
+// "jpeg80" or "webp:quality=75".
+func (m *Map) RenderToMemory(format string) ([]byte, error) {
+	b, _, err := m.RenderToMemorySolid(format)
+	return b, err
+}
+
+// RenderToMemorySolid is like RenderToMemory, but also reports whether the
+// image has a single solid color. All solid images of the same color, size
+// and format share one canonical encoding which is not encoded again.
+func (m *Map) RenderToMemorySolid(format string) ([]byte, bool, error) {
+	// encode into the map's scratch buffer, which grows to the largest tile,
+	// and return an exactly sized copy, which callers like TileCache keep
+	b, solid, err := m.appendEncoded(m.scratch[:0], format)
+	if err != nil {
+		return nil, false, err
 	}
-	defer C.mapnik_image_free(i)
-	b := C.mapnik_image_to_png_blob(i)
-	defer C.mapnik_blob_free(b)
-	return C.GoBytes(unsafe.Pointer(b.ptr), C.int(b.len)), nil
+	m.scratch = b[:0]
+	blob := make([]byte, len(b))
+	copy(blob, b)
+	return blob, solid, nil
+}
+
+// AppendPng renders the map and appends the PNG encoded image to buf.
+func (m *Map) AppendPng(buf []byte) ([]byte, error) {
+	return m.AppendEncoded(buf, "png256")
+}
+
+// AppendEncoded renders the map and appends the image encoded in format to
+// buf. The image is encoded straight into the spare capacity of buf, so
+// reusing a sufficiently large buffer across renders avoids allocating and
+// copying.
+func (m *Map) AppendEncoded(buf []byte, format string) ([]byte, error) {
+	b, _, err := m.appendEncoded(buf, format)
+	return b, err
+}
+
+func (m *Map) appendEncoded(buf []byte, format string) ([]byte, bool, error) {
+	i := m.image(m.Width(), m.Height())
+	if err := m.RenderInto(i); err != nil {
+		return buf, false, err
+	}
+	return encodeImage(i.i, format, buf)
+}
+
+// RenderInto clears i and renders the map into it. i must have the size of
+// the map.
+func (m *Map) RenderInto(i *Image) error {
+	if C.mapnik_map_render_into(m.m, i.i) != 0 {
+		return m.lastError()
+	}
+	return nil
+}
+
+func encodeImage(i *C.struct__mapnik_image_t, format string, buf []byte) ([]byte, bool, error) {
+	if cap(buf)-len(buf) < minEncodeBuffer {
+		b := make([]byte, len(buf), len(buf)+minEncodeBuffer)
+		copy(b, buf)
+		buf = b
+	}
+	cs := C.CString(format)
+	defer C.free(unsafe.Pointer(cs))
+	spare := buf[len(buf):cap(buf)]
+	var n C.size_t
+	var overflow *C.mapnik_blob_t
+	var solid C.int
+	var err *C.char
+	if C.mapnik_image_encode(i, cs, nil, (*C.char)(unsafe.Pointer(&spare[0])), C.size_t(len(spare)), &n, &overflow, &solid, &err) != 0 {
+		if err == nil {
+			return buf, false, fmt.Errorf("mapnik: could not encode image as %s", format)
+		}
+		defer C.free(unsafe.Pointer(err))
+		return buf, false, fmt.Errorf("mapnik: could not encode image as %s: %s", format, C.GoString(err))
+	}
+	if overflow == nil {
+		return buf[:len(buf)+int(n)], solid != 0, nil
+	}
+	defer C.mapnik_blob_free(overflow)
+	// grow buf and copy the overflow straight into it, with some room for
+	// larger images when buf is reused
+	total := len(buf) + int(n)
+	b := make([]byte, total, total+total/4)
+	copy(b, buf[:cap(buf)])
+	copy(b[cap(buf):], (*[1 << 30]byte)(unsafe.Pointer(overflow.ptr))[:overflow.len:overflow.len])
+	return b, solid != 0, nil
+}
+
+// Image is an RGBA raster that maps render into, see Map.RenderInto.
+// Rendering into the same image repeatedly reuses its pixel buffer.
+type Image struct {
+	i             *C.struct__mapnik_image_t
+	width, height uint32
+}
+
+func NewImage(width, height uint32) *Image {
+	return &Image{i: C.mapnik_image(C.uint(width), C.uint(height)), width: width, height: height}
+}
+
+func (i *Image) Free() {
+	C.mapnik_image_free(i.i)
+	i.i = nil
+}
+
+func (i *Image) Width() uint32 {
+	return i.width
+}
+
+func (i *Image) Height() uint32 {
+	return i.height
+}
+
+// Encode returns the image encoded in format, see Map.RenderToMemory.
+func (i *Image) Encode(format string) ([]byte, error) {
+	return i.AppendEncoded(nil, format)
+}
+
+// AppendEncoded appends the image encoded in format to buf, see
+// Map.AppendEncoded.
+func (i *Image) AppendEncoded(buf []byte, format string) ([]byte, error) {
+	b, _, err := encodeImage(i.i, format, buf)
+	return b, err
+}
+
+// RenderMetatile renders the n x n block of Web Mercator tiles whose upper
+// left tile is x/y at the given zoom level in a single pass and returns the
+// tiles encoded in format (see RenderToMemory) in row-major order, along with
+// whether each tile has a single solid color (see RenderToMemorySolid). Tiles
+// outside the tile grid are nil. The map is resized to the size of the
+// metatile.
+func (m *Map) RenderMetatile(zoom, x, y uint64, n uint, format string) ([][]byte, []bool, error) {
+	if n == 0 {
+		return nil, nil, errors.New("mapnik: empty metatile")
+	}
+	cs := C.CString(format)
+	defer C.free(unsafe.Pointer(cs))
+	// metatiles at the edge of the tile grid are clipped to it
+	cols, rows := uint64(n), uint64(n)
+	if size := uint64(1) << zoom; zoom <= 30 && x < size && y < size {
+		if x+cols > size {
+			cols = size - x
+		}
+		if y+rows > size {
+			rows = size - y
+		}
+	}
+	i := m.image(uint32(cols)*256, uint32(rows)*256)
+	tiles := make([]*C.mapnik_blob_t, n*n)
+	solid := make([]C.int, n*n)
+	if C.mapnik_map_render_metatile(m.m, C.uint(zoom), C.uint(x), C.uint(y), C.uint(n), cs, i.i, &tiles[0], &solid[0]) != 0 {
+		return nil, nil, m.lastError()
+	}
+	blobs := make([][]byte, n*n)
+	solids := make([]bool, n*n)
+	for i, b := range tiles {
+		if b != nil {
+			blobs[i] = C.GoBytes(unsafe.Pointer(b.ptr), C.int(b.len))
+			solids[i] = solid[i] != 0
+			C.mapnik_blob_free(b)
+		}
+	}
+	return blobs, solids, nil
 }
 
 func (m *Map) RenderToMemoryUTFGrid(lname string, key string, res uint) (string, error) {
@@ -216,9 +513,14 @@ func (m *Map) RenderToMemoryUTFGrid(lname string, key string, res uint) (string,
 		return "", m.lastError()
 	}
 	defer C.mapnik_grid_free(g)
-	json := C.mapnik_grid_to_json(g, C.uint(res))
+	var err *C.char
+	json := C.mapnik_grid_to_json(g, C.uint(res), &err)
 	if json == nil {
-		return "", m.lastError()
+		if err == nil {
+			return "", errors.New("mapnik: could not encode grid")
+		}
+		defer C.free(unsafe.Pointer(err))
+		return "", errors.New("mapnik: could not encode grid: " + C.GoString(err))
 	}
 	defer C.free(unsafe.Pointer(json))
 	return C.GoString(json), nil
@@ -0,0 +1,141 @@
+package mapnik
+
+// Benchmarks of the hot paths of the bindings, driven by the sample
+// stylesheet. Run with
+//
+//	go test -bench . ./mapnik [-sampledata dir]
+//
+// For the same paths measured without cgo, see bench/capi.
+
+import (
+	"flag"
+	"fmt"
+	"math"
+	"path/filepath"
+	"testing"
+)
+
+var sampledata = flag.String("sampledata", "../sampledata", "directory of the sample stylesheet and shapefile")
+
+// Zoom levels of the rendered tiles, all centered on Europe
+var benchZooms = []uint64{2, 5, 8, 11}
+
+const benchLon, benchLat = 10.0, 50.0
+
+// Returns the Web Mercator tile containing benchLon/benchLat at the given zoom
+// level.
+func tileAt(zoom uint64) (x, y uint64) {
+	n := math.Exp2(float64(zoom))
+	r := benchLat * math.Pi / 180
+	x = uint64((benchLon + 180) / 360 * n)
+	y = uint64((1 - math.Log(math.Tan(r)+1/math.Cos(r))/math.Pi) / 2 * n)
+	return
+}
+
+func loadBenchMap(b *testing.B) *Map {
+	m := NewMap(256, 256)
+	if err := m.Load(filepath.Join(*sampledata, "stylesheet.xml")); err != nil {
+		m.Free()
+		b.Fatal(err)
+	}
+	return m
+}
+
+// Runs f for each zoom level on a map zoomed to the tile at that level.
+func benchZoomed(b *testing.B, f func(b *testing.B, m *Map)) {
+	m := loadBenchMap(b)
+	defer m.Free()
+	for _, z := range benchZooms {
+		x, y := tileAt(z)
+		b.Run(fmt.Sprintf("z%d", z), func(b *testing.B) {
+			if err := m.ZoomToTile(z, x, y, 256, 128); err != nil {
+				b.Fatal(err)
+			}
+			f(b, m)
+		})
+	}
+}
+
+func BenchmarkMapLoad(b *testing.B) {
+	for i := 0; i < b.N; i++ {
+		loadBenchMap(b).Free()
+	}
+}
+
+func BenchmarkProjectionForward(b *testing.B) {
+	m := loadBenchMap(b)
+	defer m.Free()
+	p := m.Projection()
+	defer p.Free()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		p.Forward(Coord{X: benchLon, Y: benchLat})
+	}
+}
+
+func BenchmarkProjectionForwardMany1024(b *testing.B) {
+	m := loadBenchMap(b)
+	defer m.Free()
+	p := m.Projection()
+	defer p.Free()
+	coords := make([]Coord, 1024)
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		for k := range coords {
+			coords[k] = Coord{X: benchLon, Y: benchLat}
+		}
+		p.ForwardMany(coords)
+	}
+}
+
+func BenchmarkRenderToImage(b *testing.B) {
+	benchZoomed(b, func(b *testing.B, m *Map) {
+		img := NewImage(256, 256)
+		defer img.Free()
+		b.ResetTimer()
+		for i := 0; i < b.N; i++ {
+			if err := m.RenderInto(img); err != nil {
+				b.Fatal(err)
+			}
+		}
+	})
+}
+
+func BenchmarkEncodePng(b *testing.B) {
+	benchZoomed(b, func(b *testing.B, m *Map) {
+		img := NewImage(256, 256)
+		defer img.Free()
+		if err := m.RenderInto(img); err != nil {
+			b.Fatal(err)
+		}
+		buf := make([]byte, 0, 64<<10)
+		b.ResetTimer()
+		for i := 0; i < b.N; i++ {
+			blob, err := img.AppendEncoded(buf[:0], "png256")
+			if err != nil {
+				b.Fatal(err)
+			}
+			b.SetBytes(int64(len(blob)))
+		}
+	})
+}
+
+func BenchmarkRenderToMemory(b *testing.B) {
+	benchZoomed(b, func(b *testing.B, m *Map) {
+		for i := 0; i < b.N; i++ {
+			if _, err := m.RenderToMemory("png256"); err != nil {
+				b.Fatal(err)
+			}
+		}
+	})
+}
+
+func BenchmarkRenderUTFGrid(b *testing.B) {
+	benchZoomed(b, func(b *testing.B, m *Map) {
+		for i := 0; i < b.N; i++ {
+			if _, err := m.RenderToMemoryUTFGrid("world", "ISO2", 4); err != nil {
+				b.Fatal(err)
+			}
+		}
+	})
+}
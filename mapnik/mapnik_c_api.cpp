@@ -7,13 +7,13 @@
 #include <mapnik/datasource.hpp>
 #include <mapnik/datasource_cache.hpp>
 #include <mapnik/projection.hpp>
+#include <mapnik/well_known_srs.hpp>
 #include <mapnik/font_engine_freetype.hpp>
 #include <mapnik/layer.hpp>
 #include <mapnik/grid/grid.hpp>
 #include <mapnik/grid/grid_renderer.hpp>
 #include <mapnik/feature_layer_desc.hpp>
 #include <mapnik/image_reader.hpp>
-#include <json/json.h>
 
 // see https://github.com/mapnik/mapnik/issues/811
 #ifdef HAVE_PNG
@@ -22,9 +22,11 @@
 
 #if MAPNIK_VERSION >= 300000
 #include <mapnik/image.hpp>
+#include <mapnik/image_view.hpp>
 #define mapnik_image_type image_rgba8
 #else
 #include <mapnik/graphics.hpp>
+#include <mapnik/image_view.hpp>
 #define mapnik_image_type image_32
 #endif
 
@@ -32,6 +34,16 @@
 #include "mapnik_c_api.h"
 
 #include <stdlib.h>
+#include <cmath>
+#include <algorithm>
+#include <ostream>
+#include <streambuf>
+#include <new>
+#include <cstdio>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <chrono>
 
 using namespace std;
 using namespace mapnik;
@@ -80,115 +92,467 @@ void mapnik_grid_free(mapnik_grid_t * g) {
     }
 }
 
-void utf8_append(string& s, unsigned cp) {
-    if (cp <= 0x7f) {
-        s += (char) cp;
-    } else if (cp <= 0x7ff) {
-        s += (char) (0xc0 | (cp >> 6));
-        s += (char) (0x80 | (cp & 0x3f));
-    } else if (cp <= 0xffff) {
-        s += (char) (0xe0 | (cp >> 12));
-        s += (char) (0x80 | ((cp >> 6) & 0x3f));
-        s += (char) (0x80 | (cp & 0x3f));
-    } else if (cp <= 0x1fffff) {
-        s += (char) (0xf0 | (cp >> 18));
-        s += (char) (0x80 | ((cp >> 12) & 0x3f));
-        s += (char) (0x80 | ((cp >> 6) & 0x3f));
-        s += (char) (0x80 | (cp & 0x3f));
+// Growable malloc'd buffer the UTFGrid document is written into while the
+// grid is scanned. It is handed to the caller of mapnik_grid_to_json as is.
+class json_writer {
+public:
+    explicit json_writer(size_t capacity)
+        : data_((char *) malloc(capacity)), len_(0), cap_(capacity) {
+        if (!data_) throw bad_alloc();
     }
+
+    ~json_writer() {
+        free(data_);
+    }
+
+    void put(char c) {
+        reserve(1);
+        data_[len_++] = c;
+    }
+
+    void write(const char * s, size_t n) {
+        reserve(n);
+        memcpy(data_ + len_, s, n);
+        len_ += n;
+    }
+
+    void write(const char * s) {
+        write(s, strlen(s));
+    }
+
+    // Writes count copies of the UTF-8 encoding of cp.
+    void utf8(unsigned cp, size_t count = 1) {
+        char buf[4];
+        size_t n = 0;
+        if (cp <= 0x7f) {
+            reserve(count);
+            memset(data_ + len_, (int) cp, count);
+            len_ += count;
+            return;
+        } else if (cp <= 0x7ff) {
+            buf[n++] = (char) (0xc0 | (cp >> 6));
+            buf[n++] = (char) (0x80 | (cp & 0x3f));
+        } else if (cp <= 0xffff) {
+            buf[n++] = (char) (0xe0 | (cp >> 12));
+            buf[n++] = (char) (0x80 | ((cp >> 6) & 0x3f));
+            buf[n++] = (char) (0x80 | (cp & 0x3f));
+        } else if (cp <= 0x1fffff) {
+            buf[n++] = (char) (0xf0 | (cp >> 18));
+            buf[n++] = (char) (0x80 | ((cp >> 12) & 0x3f));
+            buf[n++] = (char) (0x80 | ((cp >> 6) & 0x3f));
+            buf[n++] = (char) (0x80 | (cp & 0x3f));
+        }
+        reserve(n * count);
+        for (size_t k = 0; k < count; k++) {
+            memcpy(data_ + len_, buf, n);
+            len_ += n;
+        }
+    }
+
+    void quoted(string const& s) {
+        put('"');
+        for (string::const_iterator c = s.begin(); c != s.end(); ++c) {
+            switch (*c) {
+            case '"': write("\\\"", 2); break;
+            case '\\': write("\\\\", 2); break;
+            case '\b': write("\\b", 2); break;
+            case '\f': write("\\f", 2); break;
+            case '\n': write("\\n", 2); break;
+            case '\r': write("\\r", 2); break;
+            case '\t': write("\\t", 2); break;
+            default:
+                if ((unsigned char) *c < 0x20) {
+                    char buf[8];
+                    write(buf, snprintf(buf, sizeof(buf), "\\u%04X", (unsigned char) *c));
+                } else {
+                    put(*c);
+                }
+            }
+        }
+        put('"');
+    }
+
+    void number(long long v) {
+        char buf[32];
+        write(buf, snprintf(buf, sizeof(buf), "%lld", v));
+    }
+
+    void number(double v) {
+        char buf[32];
+        if (std::isfinite(v)) {
+            write(buf, snprintf(buf, sizeof(buf), "%.17g", v));
+        } else if (v != v) {
+            write("null");
+        } else {
+            write(v < 0 ? "-1e+9999" : "1e+9999");
+        }
+    }
+
+    // Terminates the document and transfers ownership of it to the caller.
+    char * release() {
+        put('\0');
+        char * data = data_;
+        data_ = NULL;
+        return data;
+    }
+
+private:
+    void reserve(size_t n) {
+        if (len_ + n > cap_) {
+            size_t cap = max(2 * cap_, len_ + n);
+            char * data = (char *) realloc(data_, cap);
+            if (!data) throw bad_alloc();
+            data_ = data;
+            cap_ = cap;
+        }
+    }
+
+    char * data_;
+    size_t len_;
+    size_t cap_;
+};
+
+// Number of leading elements of row[0..n) equal to id. Compares blocks of
+// eight ids without early exit so that the compiler can vectorize the scan.
+inline size_t grid_run_length(const value_integer * row, size_t n, value_integer id) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        bool differs = false;
+        for (size_t k = 0; k < 8; k++) {
+            differs |= row[i + k] != id;
+        }
+        if (differs) break;
+    }
+    while (i < n && row[i] == id) i++;
+    return i;
 }
 
-char * mapnik_grid_to_json(mapnik_grid_t * g, unsigned res) {
-    char * json = NULL;
-    if (g && g->g) {
-        Json::Value root(Json::objectValue);
-        root["keys"] = Json::Value(Json::arrayValue);
-        root["data"] = Json::Value(Json::objectValue);
-        root["grid"] = Json::Value(Json::arrayValue);
+char * mapnik_grid_to_json(mapnik_grid_t * g, unsigned res, char ** err) {
+    if (!g || !g->g) {
+        return NULL;
+    }
+    if (res == 0) {
+        res = 1;
+    }
+    try {
+        grid const& gr = *g->g;
+        size_t width = gr.data().width();
+        size_t height = gr.data().height();
+        // one byte per sampled pixel is typical, plus quotes and commas per row
+        size_t cols = (width + res - 1) / res;
+        size_t rows = (height + res - 1) / res;
+        json_writer out(rows * (cols + 3) + 1024);
 
         using feature_keys_type = map<value_integer, string>;
-        feature_keys_type feature_keys = g->g->get_feature_keys();
-        feature_keys_type::const_iterator feature_key_itr;
-
-        using keys_type = map<grid::lookup_type, grid::value_type>;
-        keys_type keys;
-        unsigned codepoint = ' ';
-
-        for (size_t y = 0; y < g->g->data().height(); y=y+res) {
-            const value_integer * row = g->g->get_row(y);
-            string s;
-            for (size_t x = 0; x < g->g->data().width(); x=x+res) {
-                feature_key_itr = feature_keys.find(row[x]);
-                if (feature_key_itr == feature_keys.end()) continue;
-
-                grid::lookup_type key = feature_key_itr->second;
-                keys_type::iterator key_itr = keys.find(key);
-                if (key_itr == keys.end()) {
-                    if (row[x] == grid::base_mask) {
-                        keys[""] = codepoint;
-                        root["keys"].append("");
-                    } else {
-                        keys[key] = codepoint;
-                        root["keys"].append(key);
+        feature_keys_type const& feature_keys = gr.get_feature_keys();
+
+        // codepoint per feature id, 0 for ids without a feature key
+        unordered_map<value_integer, unsigned> codepoints;
+        unordered_map<grid::lookup_type, unsigned> keys;
+        vector<grid::lookup_type> key_list;
+        unsigned next_codepoint = ' ';
+
+        out.write("{\"grid\":[");
+        for (size_t y = 0; y < height; y=y+res) {
+            const value_integer * row = gr.get_row(y);
+            if (y > 0) out.put(',');
+            out.put('"');
+            size_t x = 0;
+            while (x < width) {
+                value_integer id = row[x];
+                unsigned codepoint;
+                unordered_map<value_integer, unsigned>::const_iterator cp_itr = codepoints.find(id);
+                if (cp_itr != codepoints.end()) {
+                    codepoint = cp_itr->second;
+                } else {
+                    codepoint = 0;
+                    feature_keys_type::const_iterator feature_key_itr = feature_keys.find(id);
+                    if (feature_key_itr != feature_keys.end()) {
+                        grid::lookup_type key = id == grid::base_mask ? "" : feature_key_itr->second;
+                        unordered_map<grid::lookup_type, unsigned>::const_iterator key_itr = keys.find(key);
+                        if (key_itr != keys.end()) {
+                            codepoint = key_itr->second;
+                        } else {
+                            codepoint = next_codepoint++;
+                            if (next_codepoint == '"' || next_codepoint == '\\') next_codepoint++;
+                            keys[key] = codepoint;
+                            key_list.push_back(key);
+                        }
                     }
-                    utf8_append(s, codepoint);
-                    codepoint++;
-                    if (codepoint == '"' || codepoint == '\\') codepoint++;
+                    codepoints[id] = codepoint;
+                }
+
+                // adjacent pixels almost always belong to the same feature,
+                // so resolve the id once per run
+                size_t run;
+                if (res == 1) {
+                    run = 1 + grid_run_length(row + x + 1, width - x - 1, id);
+                    x += run;
                 } else {
-                    utf8_append(s, key_itr->second);
+                    run = 0;
+                    do {
+                        run++;
+                        x += res;
+                    } while (x < width && row[x] == id);
+                }
+                if (codepoint != 0) {
+                    out.utf8(codepoint, run);
                 }
             }
-            root["grid"].append(s);
+            out.put('"');
         }
 
+        out.write("],\"keys\":[");
+        for (size_t k = 0; k < key_list.size(); k++) {
+            if (k > 0) out.put(',');
+            out.quoted(key_list[k]);
+        }
+
+        out.write("],\"data\":{");
         using features_type = map<grid::lookup_type, feature_ptr>;
-        features_type const& features = g->g->get_grid_features();
-        for (keys_type::iterator itr = keys.begin(); itr != keys.end(); itr++) {
-            features_type::const_iterator feature_itr = features.find(itr->first);
+        features_type const& features = gr.get_grid_features();
+        bool first_feature = true;
+        for (size_t k = 0; k < key_list.size(); k++) {
+            features_type::const_iterator feature_itr = features.find(key_list[k]);
             if (feature_itr == features.end()) continue;
             feature_ptr feature = feature_itr->second;
 
-            Json::Value feature_json = Json::Value(Json::objectValue);
-            for (string const& field : g->g->get_fields()) {
-                if (feature->has_key(field)) {
-                    feature_impl::value_type const& v = feature->get(field);
-                    switch(v.which()) { // :(
-                    case 0:
-                        // null value; do nothing
-                        break;
-                    case 1:
-                        feature_json[field] = Json::Value(v.to_bool());
-                        break;
-                    case 2:
-                        feature_json[field] = Json::Value((Json::LargestInt) v.to_int());
-                        break;
-                    case 3:
-                        feature_json[field] = Json::Value(v.to_double());
-                        break;
-                    case 4:
-                        feature_json[field] = Json::Value(v.to_string());
-                        break;
-                    }
+            if (!first_feature) out.put(',');
+            first_feature = false;
+            out.quoted(key_list[k]);
+            out.write(":{");
+            bool first_field = true;
+            for (string const& field : gr.get_fields()) {
+                if (!feature->has_key(field)) continue;
+                feature_impl::value_type const& v = feature->get(field);
+                int which = v.which();
+                if (which < 1 || which > 4) continue; // null values are left out
+                if (!first_field) out.put(',');
+                first_field = false;
+                out.quoted(field);
+                out.put(':');
+                switch(which) { // :(
+                case 1:
+                    out.write(v.to_bool() ? "true" : "false");
+                    break;
+                case 2:
+                    out.number((long long) v.to_int());
+                    break;
+                case 3:
+                    out.number(v.to_double());
+                    break;
+                case 4:
+                    out.quoted(v.to_string());
+                    break;
                 }
             }
-            root["data"][itr->first] = feature_json;
+            out.put('}');
+        }
+        out.write("}}");
+        return out.release();
+    } catch (exception const& ex) {
+        if (err != NULL) {
+            *err = strdup(ex.what());
+        }
+        return NULL;
+    }
+}
+
+inline double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Statistics of the last render of a map. They are shared with the image
+// rendered into, so that encoding the image is accounted for as well.
+struct render_stats {
+    mapnik_render_stats_t s;
+    vector<mapnik_layer_stats_t> layers;
+    vector<string> names;
+
+    render_stats() {
+        reset(vector<layer>());
+    }
+
+    void reset(vector<layer> const& map_layers) {
+        names.clear();
+        for (size_t k = 0; k < map_layers.size(); k++) {
+            names.push_back(map_layers[k].name());
+        }
+        layers.assign(names.size(), mapnik_layer_stats_t());
+        for (size_t k = 0; k < names.size(); k++) {
+            layers[k].name = names[k].c_str();
+        }
+        s.render_seconds = 0;
+        s.encode_seconds = 0;
+        s.encoded_bytes = 0;
+        s.layer_count = layers.size();
+        s.layers = layers.data();
+    }
+};
+
+using render_stats_ptr = shared_ptr<render_stats>;
+
+#if MAPNIK_VERSION >= 300000
+// Counts the features read from a layer's datasource and times reading
+// them. Mapnik queries all layers before rendering any of them, so the time
+// runs from the first feature requested until the last one was returned,
+// which includes rendering each feature but not the other layers.
+class counting_featureset : public Featureset {
+public:
+    counting_featureset(featureset_ptr const& fs, render_stats_ptr const& stats, size_t index)
+        : fs_(fs), stats_(stats), index_(index) {}
+
+    ~counting_featureset() {
+        finish();
+    }
+
+    feature_ptr next() {
+        if (!started_) {
+            start_ = chrono::steady_clock::now();
+            started_ = true;
+        }
+        feature_ptr f = fs_->next();
+        if (f) {
+            features_++;
+        } else {
+            finish();
         }
+        return f;
+    }
 
-        Json::StreamWriterBuilder wbuilder;
-        wbuilder["commentStyle"] = "None";
-        wbuilder["indentation"] = "";
-        string s = Json::writeString(wbuilder, root);
-        json = (char *) malloc(s.size()+1);
-        memcpy(json, s.c_str(), s.size()+1);
+private:
+    void finish() {
+        if (done_ || index_ >= stats_->layers.size()) {
+            return;
+        }
+        done_ = true;
+        if (started_) stats_->layers[index_].seconds += seconds_since(start_);
+        stats_->layers[index_].features += features_;
     }
-    return json;
+
+    featureset_ptr fs_;
+    render_stats_ptr stats_;
+    size_t index_;
+    chrono::steady_clock::time_point start_;
+    bool started_ = false;
+    bool done_ = false;
+    unsigned long long features_ = 0;
+};
+
+// Datasource proxy that records the features of the layer at index into stats.
+class counting_datasource : public datasource {
+public:
+    counting_datasource(datasource_ptr const& ds, render_stats_ptr const& stats, size_t index)
+        : datasource(ds->params()), ds_(ds), stats_(stats), index_(index) {}
+
+    datasource_ptr const& inner() const { return ds_; }
+    bool counts_into(render_stats_ptr const& stats, size_t index) const {
+        return stats_ == stats && index_ == index;
+    }
+
+    datasource_t type() const { return ds_->type(); }
+    featureset_ptr features(query const& q) const { return count(ds_->features(q)); }
+    featureset_ptr features_with_context(query const& q, processor_context_ptr ctx) const {
+        return count(ds_->features_with_context(q, ctx));
+    }
+    featureset_ptr features_at_point(coord2d const& pt, double tol) const { return ds_->features_at_point(pt, tol); }
+    processor_context_ptr get_context(feature_style_context_map & ctx) const { return ds_->get_context(ctx); }
+    box2d<double> envelope() const { return ds_->envelope(); }
+    boost::optional<datasource_geometry_t> get_geometry_type() const { return ds_->get_geometry_type(); }
+    layer_descriptor get_descriptor() const { return ds_->get_descriptor(); }
+
+private:
+    featureset_ptr count(featureset_ptr const& fs) const {
+        if (!fs) return fs;
+        return make_shared<counting_featureset>(fs, stats_, index_);
+    }
+
+    datasource_ptr ds_;
+    render_stats_ptr stats_;
+    size_t index_;
+};
+
+#endif
+
+// Removes the counting proxies from the layers of map.
+void unwrap_datasources(Map & map) {
+#if MAPNIK_VERSION >= 300000
+    vector<layer> & layers = map.layers();
+    for (size_t k = 0; k < layers.size(); k++) {
+        shared_ptr<counting_datasource> c = dynamic_pointer_cast<counting_datasource>(layers[k].datasource());
+        if (c) layers[k].set_datasource(c->inner());
+    }
+#else
+    (void) map;
+#endif
 }
 
 struct _mapnik_map_t {
     Map * m;
     string * err;
+    projection * proj; // transform for tile extents, created on first use
+    bool web_mercator;
+    render_stats_ptr stats; // NULL unless enabled
 };
 
+// Clears the statistics before a render and makes sure that every layer
+// counts its features into them, also layers loaded or added since the last
+// render. Mapnik 2 renders are only timed as a whole.
+void prepare_render_stats(mapnik_map_t * m) {
+    if (!m->stats) {
+        return;
+    }
+#if MAPNIK_VERSION >= 300000
+    vector<layer> & layers = m->m->layers();
+    m->stats->reset(layers);
+    for (size_t k = 0; k < layers.size(); k++) {
+        datasource_ptr ds = layers[k].datasource();
+        shared_ptr<counting_datasource> c = dynamic_pointer_cast<counting_datasource>(ds);
+        if (c && c->counts_into(m->stats, k)) {
+            continue;
+        }
+        if (c) ds = c->inner();
+        if (ds) layers[k].set_datasource(make_shared<counting_datasource>(ds, m->stats, k));
+    }
+#else
+    m->stats->reset(vector<layer>());
+#endif
+}
+
+void mapnik_map_set_render_stats(mapnik_map_t * m, int enabled) {
+    if (!m || !m->m) {
+        return;
+    }
+    if (enabled && !m->stats) {
+        m->stats = make_shared<render_stats>();
+    } else if (!enabled && m->stats) {
+        m->stats.reset();
+        unwrap_datasources(*m->m);
+    }
+}
+
+// Clears a previously used image and renders the map into it.
+void render_into(mapnik_map_t * m, mapnik_image_type & im) {
+#if MAPNIK_VERSION >= 300000
+    im.set(0);
+    im.painted(false);
+#else
+    im.data().set(0);
+#endif
+    prepare_render_stats(m);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    agg_renderer<mapnik_image_type> ren(*m->m, im);
+    ren.apply();
+    if (m->stats) m->stats->s.render_seconds = seconds_since(start);
+}
+
+const mapnik_render_stats_t * mapnik_map_render_stats(mapnik_map_t * m) {
+    if (m && m->stats) {
+        return &m->stats->s;
+    }
+    return NULL;
+}
+
 struct _mapnik_layer_t {
     layer *l;
 };
@@ -197,6 +561,23 @@ mapnik_map_t * mapnik_map(unsigned width, unsigned height) {
     mapnik_map_t * map = new mapnik_map_t;
     map->m = new Map(width,height);
     map->err = NULL;
+    map->proj = NULL;
+    return map;
+}
+
+mapnik_map_t * mapnik_map_clone(mapnik_map_t * m) {
+    if (!m || !m->m) {
+        return NULL;
+    }
+    mapnik_map_t * map = new mapnik_map_t;
+    map->m = new Map(*m->m);
+    map->err = NULL;
+    map->proj = NULL;
+    // the copied layers still count into the statistics of m
+    unwrap_datasources(*map->m);
+    if (m->stats) {
+        map->stats = make_shared<render_stats>();
+    }
     return map;
 }
 
@@ -204,6 +585,7 @@ void mapnik_map_free(mapnik_map_t * m) {
     if (m)  {
         if (m->m) delete m->m;
         if (m->err) delete m->err;
+        if (m->proj) delete m->proj;
         delete m;
     }
 }
@@ -212,6 +594,10 @@ inline void mapnik_map_reset_last_error(mapnik_map_t *m) {
     if (m && m->err) { delete m->err; m->err = NULL; }
 }
 
+inline void mapnik_map_reset_projection(mapnik_map_t *m) {
+    if (m && m->proj) { delete m->proj; m->proj = NULL; }
+}
+
 const char * mapnik_map_get_srs(mapnik_map_t * m) {
     if (m && m->m) return m->m->srs().c_str();
     return NULL;
@@ -220,6 +606,7 @@ const char * mapnik_map_get_srs(mapnik_map_t * m) {
 int mapnik_map_set_srs(mapnik_map_t * m, const char* srs) {
     if (m) {
         m->m->set_srs(srs);
+        mapnik_map_reset_projection(m);
         return 0;
     }
     return -1;
@@ -229,6 +616,7 @@ int mapnik_map_load(mapnik_map_t * m, const char* stylesheet) {
     mapnik_map_reset_last_error(m);
     if (m && m->m) {
         try {
+            mapnik_map_reset_projection(m);
             load_map(*m->m,stylesheet);
         } catch (exception const& ex) {
             m->err = new string(ex.what());
@@ -243,6 +631,7 @@ int mapnik_map_load_string(mapnik_map_t * m, const char* stylesheet_string) {
     mapnik_map_reset_last_error(m);
     if (m && m->m) {
         try {
+            mapnik_map_reset_projection(m);
             load_map_string(*m->m, stylesheet_string);
         } catch (exception const& ex) {
             m->err = new string(ex.what());
@@ -267,17 +656,20 @@ int mapnik_map_zoom_all(mapnik_map_t * m) {
     return -1;
 }
 
+bool register_readers() {
+    #ifdef HAVE_PNG
+    factory<image_reader, string, string const&>::instance().unregister_product("png");
+    factory<image_reader, string, char const*, size_t>::instance().unregister_product("png");
+    register_image_reader("png", png_reader_for_file);
+    register_image_reader("png", png_reader_for_bytes);
+    #endif
+    return true;
+}
+
 void ensure_readers_registered() {
-    static bool registered = false;
-    if (!registered) {
-        #ifdef HAVE_PNG
-        factory<image_reader, string, string const&>::instance().unregister_product("png");
-        factory<image_reader, string, char const*, size_t>::instance().unregister_product("png");
-        register_image_reader("png", png_reader_for_file);
-        register_image_reader("png", png_reader_for_bytes);
-        #endif
-        registered = true;
-    }
+    // thread-safe one-time initialization, maps may render concurrently
+    static bool registered = register_readers();
+    (void) registered;
 }
 
 int mapnik_map_render_to_file(mapnik_map_t * m, const char* filepath) {
@@ -286,9 +678,10 @@ int mapnik_map_render_to_file(mapnik_map_t * m, const char* filepath) {
     if (m && m->m) {
         try {
             mapnik_image_type buf(m->m->width(),m->m->height());
-            agg_renderer<mapnik_image_type> ren(*m->m,buf);
-            ren.apply();
+            render_into(m, buf);
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
             save_to_file(buf,filepath);
+            if (m->stats) m->stats->s.encode_seconds += seconds_since(start);
         } catch (exception const& ex) {
             m->err = new string(ex.what());
             return -1;
@@ -305,6 +698,20 @@ void mapnik_map_resize(mapnik_map_t *m, unsigned int width, unsigned int height)
     }
 }
 
+unsigned mapnik_map_width(mapnik_map_t *m) {
+    if (m && m->m) {
+        return m->m->width();
+    }
+    return 0;
+}
+
+unsigned mapnik_map_height(mapnik_map_t *m) {
+    if (m && m->m) {
+        return m->m->height();
+    }
+    return 0;
+}
+
 
 MAPNIKCAPICALL void mapnik_map_set_buffer_size(mapnik_map_t * m, int buffer_size) {
     m->m->set_buffer_size(buffer_size);
@@ -317,16 +724,32 @@ const char *mapnik_map_last_error(mapnik_map_t *m) {
     return NULL;
 }
 
+// Spherical mercator math for the common WGS84 <-> web mercator case, done
+// without calling proj4 for every point.
+static const double merc_pi = 3.14159265358979323846;
+static const double merc_radius = 6378137.0;
+static const double merc_max_latitude = 85.0511287798066;
+static const double deg_to_rad = merc_pi / 180.0;
+
+inline bool is_web_mercator(string const& srs, projection const& proj) {
+    boost::optional<bool> well_known = is_well_known_srs(srs);
+    return well_known && *well_known && !proj.is_geographic();
+}
+
 struct _mapnik_projection_t {
     projection * p;
+    bool web_mercator;
 };
 
 mapnik_projection_t * mapnik_map_projection(mapnik_map_t *m) {
     mapnik_projection_t * proj = new mapnik_projection_t;
-    if (m && m->m)
+    proj->web_mercator = false;
+    if (m && m->m) {
         proj->p = new projection(m->m->srs());
-    else
+        proj->web_mercator = is_web_mercator(m->m->srs(), *proj->p);
+    } else {
         proj->p = NULL;
+    }
     return proj;
 }
 
@@ -340,12 +763,44 @@ void mapnik_projection_free(mapnik_projection_t *p) {
 
 
 mapnik_coord_t mapnik_projection_forward(mapnik_projection_t *p, mapnik_coord_t c) {
-    if (p && p->p) {
-        p->p->forward(c.x, c.y);
-    }
+    mapnik_projection_forward_many(p, &c, 1);
     return c;
 }
 
+
+void mapnik_projection_forward_many(mapnik_projection_t *p, mapnik_coord_t *coords, size_t n) {
+    if (!p || !p->p || !coords) {
+        return;
+    }
+    if (p->web_mercator) {
+        for (size_t i = 0; i < n; i++) {
+            double lat = max(-merc_max_latitude, min(merc_max_latitude, coords[i].y));
+            coords[i].x = coords[i].x * deg_to_rad * merc_radius;
+            coords[i].y = log(tan(0.25 * merc_pi + 0.5 * lat * deg_to_rad)) * merc_radius;
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        p->p->forward(coords[i].x, coords[i].y);
+    }
+}
+
+void mapnik_projection_inverse_many(mapnik_projection_t *p, mapnik_coord_t *coords, size_t n) {
+    if (!p || !p->p || !coords) {
+        return;
+    }
+    if (p->web_mercator) {
+        for (size_t i = 0; i < n; i++) {
+            coords[i].x = coords[i].x / merc_radius / deg_to_rad;
+            coords[i].y = (2 * atan(exp(coords[i].y / merc_radius)) - 0.5 * merc_pi) / deg_to_rad;
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        p->p->inverse(coords[i].x, coords[i].y);
+    }
+}
+
 struct _mapnik_bbox_t {
     box2d<double> b;
 };
@@ -369,8 +824,15 @@ void mapnik_map_zoom_to_box(mapnik_map_t * m, mapnik_bbox_t * b) {
 
 struct _mapnik_image_t {
     mapnik_image_type *i;
+    render_stats_ptr stats; // of the map last rendered into the image
 };
 
+mapnik_image_t * mapnik_image(unsigned width, unsigned height) {
+    mapnik_image_t * i = new mapnik_image_t;
+    i->i = new mapnik_image_type(width, height);
+    return i;
+}
+
 void mapnik_image_free(mapnik_image_t * i) {
     if (i) {
         if (i->i) delete i->i;
@@ -378,6 +840,41 @@ void mapnik_image_free(mapnik_image_t * i) {
     }
 }
 
+unsigned mapnik_image_width(mapnik_image_t * i) {
+    if (i && i->i) {
+        return i->i->width();
+    }
+    return 0;
+}
+
+unsigned mapnik_image_height(mapnik_image_t * i) {
+    if (i && i->i) {
+        return i->i->height();
+    }
+    return 0;
+}
+
+
+int mapnik_map_render_into(mapnik_map_t * m, mapnik_image_t * i) {
+    ensure_readers_registered();
+    mapnik_map_reset_last_error(m);
+    if (!m || !m->m || !i || !i->i) {
+        return -1;
+    }
+    if (i->i->width() != m->m->width() || i->i->height() != m->m->height()) {
+        m->err = new string("image size does not match map size");
+        return -1;
+    }
+    try {
+        render_into(m, *i->i);
+        i->stats = m->stats;
+    } catch (exception const& ex) {
+        m->err = new string(ex.what());
+        return -1;
+    }
+    return 0;
+}
+
 mapnik_image_t * mapnik_map_render_to_image(mapnik_map_t * m) {
     ensure_readers_registered();
     mapnik_map_reset_last_error(m);
@@ -385,8 +882,7 @@ mapnik_image_t * mapnik_map_render_to_image(mapnik_map_t * m) {
     if (m && m->m) {
         im = new mapnik_image_type(m->m->width(), m->m->height());
         try {
-            agg_renderer<mapnik_image_type> ren(*m->m,*im);
-            ren.apply();
+            render_into(m, *im);
         } catch (exception const& ex) {
             delete im;
             m->err = new string(ex.what());
@@ -395,6 +891,7 @@ mapnik_image_t * mapnik_map_render_to_image(mapnik_map_t * m) {
     }
     mapnik_image_t * i = new mapnik_image_t;
     i->i = im;
+    if (m) i->stats = m->stats;
     return i;
 }
 
@@ -439,9 +936,13 @@ mapnik_grid_t * mapnik_map_render_to_grid(mapnik_map_t * m, mapnik_layer_t * l,
         }
 
         try {
+            // the grid render replaces the statistics of the last render
+            prepare_render_stats(m);
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
             grid_renderer<grid> ren(*m->m,*g);
             set<string> fields(g->get_fields());
             ren.apply(*l->l, fields, 4);
+            if (m->stats) m->stats->s.render_seconds = seconds_since(start);
         } catch (exception const& ex) {
             delete g;
             m->err = new string(ex.what());
@@ -461,19 +962,238 @@ void mapnik_blob_free(mapnik_blob_t * b) {
     }
 }
 
+inline mapnik_blob_t * mapnik_blob_from_string(string const& s) {
+    mapnik_blob_t * blob = new mapnik_blob_t;
+    blob->len = s.length();
+    blob->ptr = new char[blob->len];
+    memcpy(blob->ptr, s.c_str(), blob->len);
+    return blob;
+}
+
 mapnik_blob_t * mapnik_image_to_png_blob(mapnik_image_t * i) {
+    if (i && i->i) {
+        return mapnik_blob_from_string(save_to_string(*(i->i), "png256"));
+    }
     mapnik_blob_t * blob = new mapnik_blob_t;
     blob->ptr = NULL;
     blob->len = 0;
-    if (i && i->i) {
-        string s = save_to_string(*(i->i), "png256");
-        blob->len = s.length();
-        blob->ptr = new char[blob->len];
-        memcpy(blob->ptr, s.c_str(), blob->len);
-    }
     return blob;
 }
 
+// Output buffer that writes into caller-owned memory and spills whatever does
+// not fit into an overflow string, so encoders can stream straight into it.
+class fixed_streambuf : public streambuf {
+public:
+    fixed_streambuf(char * buf, size_t cap) {
+        setp(buf, buf + cap);
+    }
+
+    size_t size() const {
+        return (pptr() - pbase()) + overflow_.size();
+    }
+
+    string const& overflow_data() const {
+        return overflow_;
+    }
+
+protected:
+    int_type overflow(int_type ch) {
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            overflow_ += traits_type::to_char_type(ch);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    streamsize xsputn(const char * s, streamsize n) {
+        streamsize k = min(n, (streamsize) (epptr() - pptr()));
+        memcpy(pptr(), s, k);
+        pbump((int) k);
+        if (k < n) {
+            overflow_.append(s + k, n - k);
+        }
+        return n;
+    }
+
+private:
+    string overflow_;
+};
+
+extern "C++" {
+
+#if MAPNIK_VERSION >= 300000
+// Whether all pixels of im have the same value. The inner loop is a plain
+// OR-reduction over the row so that the compiler vectorizes it.
+template <typename Image>
+bool is_solid(Image const& im, unsigned & color) {
+    using pixel_type = typename Image::pixel_type;
+    if (im.width() == 0 || im.height() == 0) {
+        return false;
+    }
+    pixel_type const first = im.get_row(0)[0];
+    size_t const width = im.width();
+    for (size_t y = 0; y < im.height(); y++) {
+        pixel_type const* row = im.get_row(y);
+        pixel_type diff = 0;
+        for (size_t x = 0; x < width; x++) {
+            diff |= row[x] ^ first;
+        }
+        if (diff) {
+            return false;
+        }
+    }
+    color = first;
+    return true;
+}
+#else
+// Mapnik 2 images are always encoded
+template <typename Image>
+bool is_solid(Image const&, unsigned &) {
+    return false;
+}
+#endif
+
+// Encodings of solid images by size, color and format. Large parts of most
+// maps (oceans, empty background) render as solid tiles, which then share a
+// single encoding instead of running the encoder for each of them.
+static mutex solid_encodings_mutex;
+static unordered_map<string, string> solid_encodings;
+static const size_t max_solid_encodings = 1024;
+
+template <typename Image>
+string encode_solid(Image const& im, unsigned color, string const& format) {
+    char key[64];
+    snprintf(key, sizeof(key), "%ux%u:%08x:", (unsigned) im.width(), (unsigned) im.height(), (unsigned) color);
+    string k = key + format;
+    {
+        lock_guard<mutex> lock(solid_encodings_mutex);
+        unordered_map<string, string>::const_iterator it = solid_encodings.find(k);
+        if (it != solid_encodings.end()) {
+            return it->second;
+        }
+    }
+    string encoded = save_to_string(im, format);
+    lock_guard<mutex> lock(solid_encodings_mutex);
+    if (solid_encodings.size() >= max_solid_encodings) {
+        solid_encodings.clear();
+    }
+    solid_encodings.emplace(k, encoded);
+    return encoded;
+}
+
+template <typename Image>
+string encode(Image const& im, string const& format, int * solid) {
+    unsigned color;
+    bool s = is_solid(im, color);
+    if (solid) *solid = s;
+    return s ? encode_solid(im, color, format) : save_to_string(im, format);
+}
+
+}
+
+static const unsigned tile_size = 256;
+
+inline bool valid_tile(unsigned z, unsigned x, unsigned y) {
+    return z <= 30 && x < (1u << z) && y < (1u << z);
+}
+
+// Extent in the map's srs of the Web Mercator tiles from x0/y0 up to but not
+// including x1/y1 at zoom level z, see fromPixelToLL in maptiles.
+box2d<double> mapnik_map_tile_extent(mapnik_map_t * m, unsigned z, unsigned x0, unsigned y0, unsigned x1, unsigned y1) {
+    if (!m->proj) {
+        m->proj = new projection(m->m->srs());
+        m->web_mercator = is_web_mercator(m->m->srs(), *m->proj);
+    }
+    double n = ldexp(1.0, z);
+    if (m->web_mercator) {
+        double h = merc_pi * merc_radius;
+        return box2d<double>((2 * x0 / n - 1) * h, (1 - 2 * y1 / n) * h, (2 * x1 / n - 1) * h, (1 - 2 * y0 / n) * h);
+    }
+    double minx = x0 / n * 360.0 - 180.0;
+    double maxx = x1 / n * 360.0 - 180.0;
+    double miny = atan(sinh(merc_pi * (1 - 2 * y1 / n))) / deg_to_rad;
+    double maxy = atan(sinh(merc_pi * (1 - 2 * y0 / n))) / deg_to_rad;
+    m->proj->forward(minx, miny);
+    m->proj->forward(maxx, maxy);
+    return box2d<double>(minx, miny, maxx, maxy);
+}
+
+int mapnik_map_zoom_to_tile(mapnik_map_t * m, unsigned z, unsigned x, unsigned y, unsigned size, int buffer_size) {
+    mapnik_map_reset_last_error(m);
+    if (!m || !m->m) {
+        return -1;
+    }
+    if (!valid_tile(z, x, y)) {
+        m->err = new string("invalid tile");
+        return -1;
+    }
+    try {
+        box2d<double> extent = mapnik_map_tile_extent(m, z, x, y, x + 1, y + 1);
+        m->m->resize(size, size);
+        m->m->zoom_to_box(extent);
+        m->m->set_buffer_size(buffer_size);
+    } catch (exception const& ex) {
+        m->err = new string(ex.what());
+        return -1;
+    }
+    return 0;
+}
+
+int mapnik_map_render_metatile(mapnik_map_t * m, unsigned z, unsigned x, unsigned y, unsigned n, const char * format, mapnik_image_t * im, mapnik_blob_t ** tiles, int * solid) {
+    ensure_readers_registered();
+    mapnik_map_reset_last_error(m);
+    if (!m || !m->m || !tiles) {
+        return -1;
+    }
+    if (n == 0 || !valid_tile(z, x, y)) {
+        m->err = new string("invalid metatile");
+        return -1;
+    }
+    for (unsigned k = 0; k < n * n; k++) {
+        tiles[k] = NULL;
+        if (solid) solid[k] = 0;
+    }
+    // clip the metatile to the tile grid
+    unsigned cols = min(n, (1u << z) - x);
+    unsigned rows = min(n, (1u << z) - y);
+    try {
+        box2d<double> extent = mapnik_map_tile_extent(m, z, x, y, x + cols, y + rows);
+        m->m->resize(cols * tile_size, rows * tile_size);
+        m->m->zoom_to_box(extent);
+        unique_ptr<mapnik_image_type> tmp;
+        mapnik_image_type * buf = im ? im->i : NULL;
+        if (!buf || buf->width() != m->m->width() || buf->height() != m->m->height()) {
+            tmp.reset(new mapnik_image_type(m->m->width(), m->m->height()));
+            buf = tmp.get();
+        }
+        render_into(m, *buf);
+
+        string f(format ? format : "png256");
+        for (unsigned row = 0; row < rows; row++) {
+            for (unsigned col = 0; col < cols; col++) {
+#if MAPNIK_VERSION >= 300000
+                image_view<mapnik_image_type> view(col * tile_size, row * tile_size, tile_size, tile_size, *buf);
+#else
+                image_view<image_data_32> view(col * tile_size, row * tile_size, tile_size, tile_size, buf->data());
+#endif
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                tiles[row * n + col] = mapnik_blob_from_string(encode(view, f, solid ? &solid[row * n + col] : NULL));
+                if (m->stats) {
+                    m->stats->s.encode_seconds += seconds_since(start);
+                    m->stats->s.encoded_bytes += tiles[row * n + col]->len;
+                }
+            }
+        }
+    } catch (exception const& ex) {
+        for (unsigned k = 0; k < n * n; k++) {
+            mapnik_blob_free(tiles[k]);
+            tiles[k] = NULL;
+        }
+        m->err = new string(ex.what());
+        return -1;
+    }
+    return 0;
+}
+
 struct _mapnik_parameters_t {
     parameters *p;
 };
@@ -497,6 +1217,93 @@ void mapnik_parameters_set(mapnik_parameters_t *p, const char *key, const char *
     }
 }
 
+inline string mapnik_format_string(const char * format, mapnik_parameters_t * options) {
+    string f(format ? format : "png256");
+    if (options && options->p) {
+        for (parameters::const_iterator it = options->p->begin(); it != options->p->end(); ++it) {
+            boost::optional<string> v = options->p->get<string>(it->first);
+            f += ":" + it->first;
+            if (v && !v->empty()) {
+                f += "=" + *v;
+            }
+        }
+    }
+    return f;
+}
+
+int mapnik_image_encode(mapnik_image_t * i, const char * format, mapnik_parameters_t * options, char * buf, size_t cap, size_t * len, mapnik_blob_t ** overflow, int * solid, char ** err) {
+    if (!i || !i->i || !len || !overflow) {
+        return -1;
+    }
+    *len = 0;
+    *overflow = NULL;
+    try {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        string f = mapnik_format_string(format, options);
+        fixed_streambuf sb(buf, cap);
+        unsigned color;
+        bool s = is_solid(*(i->i), color);
+        if (solid) *solid = s;
+        if (s) {
+            string encoded = encode_solid(*(i->i), color, f);
+            sb.sputn(encoded.data(), encoded.size());
+        } else if (f.compare(0, 4, "tiff") == 0) {
+            // the TIFF writer needs a seekable stream
+            string encoded = save_to_string(*(i->i), f);
+            sb.sputn(encoded.data(), encoded.size());
+        } else {
+            ostream out(&sb);
+            save_to_stream(*(i->i), out, f);
+            out.flush();
+        }
+        *len = sb.size();
+        if (!sb.overflow_data().empty()) {
+            *overflow = mapnik_blob_from_string(sb.overflow_data());
+        }
+        if (i->stats) {
+            i->stats->s.encode_seconds += seconds_since(start);
+            i->stats->s.encoded_bytes += *len;
+        }
+    } catch (exception const& ex) {
+        if (err != NULL) {
+            *err = strdup(ex.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int mapnik_image_to_png_buffer(mapnik_image_t * i, char * buf, size_t cap, size_t * len, mapnik_blob_t ** overflow) {
+    return mapnik_image_encode(i, "png256", NULL, buf, cap, len, overflow, NULL, NULL);
+}
+
+mapnik_image_cache_stats_t mapnik_image_cache_stats() {
+    mapnik_image_cache_stats_t s = { 0, 0, 0, 0, 0 };
+    #ifdef HAVE_PNG
+    decoded_image_cache::stats cs = decoded_image_cache::instance().get_stats();
+    s.hits = cs.hits;
+    s.misses = cs.misses;
+    s.bytes = cs.bytes;
+    s.images = cs.images;
+    s.max_bytes = cs.max_bytes;
+    #endif
+    return s;
+}
+
+void mapnik_image_cache_set_max_bytes(size_t max_bytes) {
+    #ifdef HAVE_PNG
+    decoded_image_cache::instance().set_max_bytes(max_bytes);
+    #else
+    (void) max_bytes;
+    #endif
+}
+
+void mapnik_image_cache_clear() {
+    #ifdef HAVE_PNG
+    decoded_image_cache::instance().clear();
+    #endif
+}
+
 struct _mapnik_datasource_t {
     datasource_ptr ds;
 };
@@ -7,6 +7,8 @@
 #  define MAPNIKCAPICALL __attribute__ ((visibility ("default")))
 #endif
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -28,8 +30,17 @@ typedef struct _mapnik_projection_t mapnik_projection_t;
 
 MAPNIKCAPICALL void mapnik_projection_free(mapnik_projection_t *p);
 
+// Transforms c from longitude/latitude to the projection. Web mercator is
+// transformed without proj4, with latitudes clamped to +-85.0511 degrees,
+// the limit of the square web mercator world.
 MAPNIKCAPICALL mapnik_coord_t mapnik_projection_forward(mapnik_projection_t *p, mapnik_coord_t c);
 
+// Transform the n coordinates in coords in place from longitude/latitude to
+// the projection and back, like mapnik_projection_forward.
+MAPNIKCAPICALL void mapnik_projection_forward_many(mapnik_projection_t *p, mapnik_coord_t *coords, size_t n);
+
+MAPNIKCAPICALL void mapnik_projection_inverse_many(mapnik_projection_t *p, mapnik_coord_t *coords, size_t n);
+
 
 // Bbox
 typedef struct _mapnik_bbox_t mapnik_bbox_t;
@@ -51,8 +62,14 @@ MAPNIKCAPICALL void mapnik_blob_free(mapnik_blob_t * b);
 // Image
 typedef struct _mapnik_image_t mapnik_image_t;
 
+MAPNIKCAPICALL mapnik_image_t * mapnik_image(unsigned width, unsigned height);
+
 MAPNIKCAPICALL void mapnik_image_free(mapnik_image_t * i);
 
+MAPNIKCAPICALL unsigned mapnik_image_width(mapnik_image_t * i);
+
+MAPNIKCAPICALL unsigned mapnik_image_height(mapnik_image_t * i);
+
 MAPNIKCAPICALL mapnik_blob_t * mapnik_image_to_png_blob(mapnik_image_t * i);
 
 
@@ -66,6 +83,41 @@ MAPNIKCAPICALL void mapnik_parameters_free(mapnik_parameters_t *p);
 MAPNIKCAPICALL void mapnik_parameters_set(mapnik_parameters_t *p, const char *key, const char *value);
 
 
+// Image encoding
+
+// Encodes the image directly into buf, which has room for cap bytes. format
+// is a Mapnik format string like "png256", "png8:z=1", "jpeg80" or "webp",
+// options (may be NULL) are appended to it as key=value pairs.
+// *len receives the encoded size; if it exceeds cap, the bytes that did not
+// fit are returned in *overflow, which must be freed with mapnik_blob_free.
+// If solid is not NULL, it is set to 1 if the image has a single color. All
+// solid images of the same color and size share one cached encoding.
+// On failure, if err is not NULL, *err receives the error message, which
+// must be freed with free.
+MAPNIKCAPICALL int mapnik_image_encode(mapnik_image_t * i, const char * format, mapnik_parameters_t * options, char * buf, size_t cap, size_t * len, mapnik_blob_t ** overflow, int * solid, char ** err);
+
+MAPNIKCAPICALL int mapnik_image_to_png_buffer(mapnik_image_t * i, char * buf, size_t cap, size_t * len, mapnik_blob_t ** overflow);
+
+
+// Decoded image cache
+// PNG files that maps read, like icons, patterns and raster inputs, are
+// decoded once per process and kept in an LRU cache of limited size.
+typedef struct _mapnik_image_cache_stats_t {
+    unsigned long long hits;
+    unsigned long long misses;
+    size_t bytes;
+    size_t images;
+    size_t max_bytes;
+} mapnik_image_cache_stats_t;
+
+MAPNIKCAPICALL mapnik_image_cache_stats_t mapnik_image_cache_stats();
+
+// Limits the cache to max_bytes of decoded images, 0 disables it.
+MAPNIKCAPICALL void mapnik_image_cache_set_max_bytes(size_t max_bytes);
+
+MAPNIKCAPICALL void mapnik_image_cache_clear();
+
+
 // Datasource
 typedef struct _mapnik_datasource_t mapnik_datasource_t;
 
@@ -95,7 +147,26 @@ typedef struct _mapnik_grid_t mapnik_grid_t;
 
 MAPNIKCAPICALL void mapnik_grid_free(mapnik_grid_t * g);
 
-MAPNIKCAPICALL char * mapnik_grid_to_json(mapnik_grid_t * g, unsigned res);
+// Returns the grid as a UTFGrid JSON document sampled every res pixels, which
+// must be freed with free. On failure, if err is not NULL, *err receives the
+// error message, which must be freed with free.
+MAPNIKCAPICALL char * mapnik_grid_to_json(mapnik_grid_t * g, unsigned res, char ** err);
+
+
+// Render statistics
+typedef struct {
+    const char * name;
+    double seconds; // reading and rendering the layer's features
+    unsigned long long features;
+} mapnik_layer_stats_t;
+
+typedef struct {
+    double render_seconds;
+    double encode_seconds;
+    size_t encoded_bytes;
+    size_t layer_count;
+    const mapnik_layer_stats_t * layers;
+} mapnik_render_stats_t;
 
 
 //  Map
@@ -105,6 +176,11 @@ MAPNIKCAPICALL mapnik_map_t * mapnik_map( unsigned int width, unsigned int heigh
 
 MAPNIKCAPICALL void mapnik_map_free(mapnik_map_t * m);
 
+// Returns an independent copy of m that shares its datasources, so a
+// stylesheet only needs to be loaded once for any number of render threads.
+// Cloning the same map from several threads at once is safe.
+MAPNIKCAPICALL mapnik_map_t * mapnik_map_clone(mapnik_map_t * m);
+
 MAPNIKCAPICALL const char * mapnik_map_last_error(mapnik_map_t * m);
 
 MAPNIKCAPICALL const char * mapnik_map_get_srs(mapnik_map_t * m);
@@ -121,14 +197,35 @@ MAPNIKCAPICALL int mapnik_map_render_to_file(mapnik_map_t * m, const char* filep
 
 MAPNIKCAPICALL void mapnik_map_resize(mapnik_map_t * m, unsigned int width, unsigned int height);
 
+MAPNIKCAPICALL unsigned mapnik_map_width(mapnik_map_t * m);
+
+MAPNIKCAPICALL unsigned mapnik_map_height(mapnik_map_t * m);
+
 MAPNIKCAPICALL void mapnik_map_set_buffer_size(mapnik_map_t * m, int buffer_size);
 
 MAPNIKCAPICALL void mapnik_map_zoom_to_box(mapnik_map_t * m, mapnik_bbox_t * b);
 
+// Resizes the map to size x size pixels and zooms to the Web Mercator tile
+// x/y at zoom level z, with a buffer of buffer_size pixels around it.
+MAPNIKCAPICALL int mapnik_map_zoom_to_tile(mapnik_map_t * m, unsigned z, unsigned x, unsigned y, unsigned size, int buffer_size);
+
 MAPNIKCAPICALL mapnik_projection_t * mapnik_map_projection(mapnik_map_t *m);
 
 MAPNIKCAPICALL mapnik_image_t * mapnik_map_render_to_image(mapnik_map_t * m);
 
+// Enables or disables collecting mapnik_render_stats_t for each render.
+// Statistics per layer need Mapnik 3, with Mapnik 2 they list no layers.
+MAPNIKCAPICALL void mapnik_map_set_render_stats(mapnik_map_t * m, int enabled);
+
+// Returns the statistics of the last render of the map and of encoding its
+// image, or NULL if they are not enabled. They are owned by the map and are
+// overwritten by the next render.
+MAPNIKCAPICALL const mapnik_render_stats_t * mapnik_map_render_stats(mapnik_map_t * m);
+
+// Clears i and renders the map into it, reusing its pixel buffer. i must
+// have the size of the map.
+MAPNIKCAPICALL int mapnik_map_render_into(mapnik_map_t * m, mapnik_image_t * i);
+
 MAPNIKCAPICALL void mapnik_map_add_layer(mapnik_map_t *m, mapnik_layer_t *l);
 
 MAPNIKCAPICALL size_t mapnik_map_layer_count(mapnik_map_t *m);
@@ -137,6 +234,15 @@ MAPNIKCAPICALL mapnik_layer_t * mapnik_map_get_layer(mapnik_map_t *m, size_t i);
 
 MAPNIKCAPICALL mapnik_grid_t * mapnik_map_render_to_grid(mapnik_map_t * m, mapnik_layer_t * l, const char * key);
 
+// Renders the n x n block of Web Mercator tiles with upper left tile x/y at
+// zoom level z in one pass. tiles must hold n*n pointers and receives the
+// tiles encoded in format (PNG if NULL) in row-major order, NULL for tiles
+// outside the tile grid. The metatile is rendered into im if it has the size
+// of the metatile, otherwise (or if im is NULL) into a temporary image. If
+// solid is not NULL, it must hold n*n ints which are set to 1 for tiles of a
+// single color, see mapnik_image_encode.
+MAPNIKCAPICALL int mapnik_map_render_metatile(mapnik_map_t * m, unsigned z, unsigned x, unsigned y, unsigned n, const char * format, mapnik_image_t * im, mapnik_blob_t ** tiles, int * solid);
+
 
 #ifdef __cplusplus
 }
@@ -3,28 +3,63 @@
 #ifdef HAVE_PNG
 
 #include <fstream>
-#include <sstream>
+#if defined(MAPNIK_MEMORY_MAPPED_FILE)
+#include <boost/interprocess/mapped_region.hpp>
+#endif
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstring>
+#include <vector>
 
 using namespace std;
 using namespace mapnik;
 
 png_reader::png_reader(istream *input) {
     input_ = input;
+    data_ = NULL;
+    size_ = 0;
+    init_();
+}
+
+png_reader::png_reader(const char *data, size_t size) {
+    input_ = NULL;
+    data_ = data;
+    size_ = size;
+    init_();
+}
 
-    png_structp pngp;
-    png_infop infop;
-    start_read_(&pngp, &infop);
+#if defined(MAPNIK_MEMORY_MAPPED_FILE)
+png_reader::png_reader(mapped_region_ptr const& region) {
+    input_ = NULL;
+    region_ = region;
+    data_ = (const char *) region->get_address();
+    size_ = region->get_size();
+    init_();
+}
+#endif
+
+void png_reader::init_() {
+    pngp_ = NULL;
+    infop_ = NULL;
+    try {
+        start_read_();
+    } catch (...) {
+        finish_read_();
+        delete input_;
+        throw;
+    }
 
     png_uint_32 width, height;
-    png_get_IHDR(pngp, infop, &width, &height, &depth_, &color_type_, NULL, NULL, NULL);
+    int interlace;
+    png_get_IHDR(pngp_, infop_, &width, &height, &depth_, &color_type_, &interlace, NULL, NULL);
     width_ = width;
     height_ = height;
     has_alpha_ = (color_type_ & PNG_COLOR_MASK_ALPHA) != 0;
-
-    png_destroy_read_struct(&pngp, &infop, NULL);
+    interlaced_ = interlace != PNG_INTERLACE_NONE;
 }
 
 png_reader::~png_reader() {
+    finish_read_();
     delete input_;
 }
 
@@ -45,46 +80,58 @@ boost::optional<box2d<double> > png_reader::bounding_box() const {
 }
 
 void png_reader::read(unsigned x, unsigned y, image_rgba8 &image) {
-    png_structp pngp;
-    png_infop infop;
-    start_read_(&pngp, &infop);
-
-    // ensure we have 8-bit RGBA
-    png_set_add_alpha(pngp, 0xff, PNG_FILLER_AFTER);
-    png_set_expand(pngp);
-    png_set_gray_to_rgb(pngp);
-    png_set_strip_16(pngp);
-    png_read_update_info(pngp, infop);
-
     unsigned h = image.height();
     unsigned w = image.width();
+    if (x + w > width_ || y + h > height_) {
+        throw image_reader_exception("png_reader: region outside of the image");
+    }
 
-    if (x == y == 0 && h == height_ && w == width_) {
-        png_bytep *rows = (png_bytep *) malloc(height_ * sizeof(png_bytep));
-        if (!rows) {
-            throw image_reader_exception("out of memory");
+    if (interlaced_ && decoded_) {
+        copy_region_(*decoded_, x, y, image);
+        return;
+    }
+
+    try {
+        if (!pngp_ || y < next_row_ || (interlaced_ && next_row_ > 0)) {
+            // the rows were decoded already, start over
+            finish_read_();
+            start_read_();
         }
-        for (unsigned i = 0; i < h; i++) {
-            rows[i] = (png_bytep) image.get_row(i);
+
+        if (interlaced_) {
+            unique_ptr<image_rgba8> decoded(new image_rgba8(width_, height_));
+            read_image_(*decoded);
+            decoded_ = move(decoded);
+            copy_region_(*decoded_, x, y, image);
+            return;
         }
-        png_read_image(pngp, rows);
-        free(rows);
-    } else {
-        unsigned rowbytes = png_get_rowbytes(pngp, infop);
-        png_bytep row = (png_bytep) malloc(width_ * rowbytes);
-        if (!row) {
-            throw image_reader_exception("out of memory");
+
+        if (x == 0 && y == 0 && h == height_ && w == width_) {
+            read_image_(image);
+            return;
         }
-        for (unsigned i = 0; i < y + h; i++) {
-            png_read_row(pngp, row, 0);
-            if (i >= y) {
-                image.set_row(i - y, (const unsigned *) (row + x * rowbytes), w);
-            }
+
+        // rows above the region still have to be inflated and unfiltered,
+        // but are not copied anywhere
+        for (; next_row_ < y; next_row_++) {
+            png_read_row(pngp_, NULL, NULL);
         }
-        free(row);
+        row_.resize(png_get_rowbytes(pngp_, infop_));
+        for (; next_row_ < y + h; next_row_++) {
+            png_read_row(pngp_, row_.data(), NULL);
+            image.set_row(next_row_ - y, (const unsigned *) row_.data() + x, w);
+        }
+    } catch (...) {
+        // the decoder cannot continue after an error, start over next time
+        finish_read_();
+        throw;
     }
+}
 
-    png_destroy_read_struct(&pngp, &infop, NULL);
+void png_reader::copy_region_(image_rgba8 const& from, unsigned x, unsigned y, image_rgba8 &image) {
+    for (unsigned i = 0; i < image.height(); i++) {
+        image.set_row(i, from.get_row(y + i) + x, image.width());
+    }
 }
 
 image_any png_reader::read(unsigned x, unsigned y, unsigned width, unsigned height) {
@@ -93,36 +140,249 @@ image_any png_reader::read(unsigned x, unsigned y, unsigned width, unsigned heig
     return image;
 }
 
+// Decodes the whole image, which must be the size of the PNG, into image.
+void png_reader::read_image_(image_rgba8 &image) {
+    // vectors rather than malloc, the decoder reports errors by throwing
+    vector<png_bytep> rows(height_);
+    for (unsigned i = 0; i < height_; i++) {
+        rows[i] = (png_bytep) image.get_row(i);
+    }
+    png_read_image(pngp_, rows.data());
+    next_row_ = height_;
+}
+
 void png_reader::user_read_fn_(png_structp pngp, png_bytep datap, png_size_t length) {
     istream *in = (istream *) png_get_io_ptr(pngp);
     in->read((char *) datap, length);
+    if ((png_size_t) in->gcount() != length) {
+        png_error(pngp, "unexpected end of data");
+    }
+}
+
+void png_reader::memory_read_fn_(png_structp pngp, png_bytep datap, png_size_t length) {
+    png_reader *r = (png_reader *) png_get_io_ptr(pngp);
+    if (length > r->size_ - r->pos_) {
+        png_error(pngp, "unexpected end of data");
+    }
+    memcpy(datap, r->data_ + r->pos_, length);
+    r->pos_ += length;
 }
 
-void png_reader::start_read_(png_structpp pngpp, png_infopp infopp) {
-    *pngpp = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!*pngpp) {
-        *infopp = NULL;
+void png_reader::user_error_fn_(png_structp, png_const_charp msg) {
+    throw image_reader_exception(string("png_reader: ") + msg);
+}
+
+void png_reader::user_warning_fn_(png_structp, png_const_charp) {
+}
+
+// Sets up the decoder at the start of the stream to return 8-bit RGBA rows.
+void png_reader::start_read_() {
+    pngp_ = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, user_error_fn_, user_warning_fn_);
+    if (!pngp_) {
         throw image_reader_exception("png_create_read_struct failed");
     }
-    *infopp = png_create_info_struct(*pngpp);
-    if (!*infopp) {
-        png_destroy_read_struct(pngpp, NULL, NULL);
-        *pngpp = NULL;
+    infop_ = png_create_info_struct(pngp_);
+    if (!infop_) {
+        png_destroy_read_struct(&pngp_, NULL, NULL);
+        pngp_ = NULL;
         throw image_reader_exception("png_create_info_struct failed");
     }
-    input_->clear();
-    input_->seekg(0);
-    png_set_read_fn(*pngpp, input_, user_read_fn_);
-    png_read_info(*pngpp, *infopp);
+    if (input_) {
+        input_->clear();
+        input_->seekg(0);
+        png_set_read_fn(pngp_, input_, user_read_fn_);
+    } else {
+        pos_ = 0;
+        png_set_read_fn(pngp_, this, memory_read_fn_);
+    }
+    png_read_info(pngp_, infop_);
+
+    // ensure we have 8-bit RGBA
+    png_set_add_alpha(pngp_, 0xff, PNG_FILLER_AFTER);
+    png_set_expand(pngp_);
+    png_set_gray_to_rgb(pngp_);
+    png_set_strip_16(pngp_);
+    png_set_interlace_handling(pngp_);
+    png_read_update_info(pngp_, infop_);
+    next_row_ = 0;
 }
 
-image_reader *png_reader_for_file(string const &file) {
+void png_reader::finish_read_() {
+    if (pngp_) {
+        png_destroy_read_struct(&pngp_, &infop_, NULL);
+        pngp_ = NULL;
+        infop_ = NULL;
+    }
+}
+
+// Decoded images up to this total size are kept by default, enough for the
+// icons and patterns of typical styles.
+static const size_t default_cache_bytes = 32 << 20;
+
+decoded_image_cache& decoded_image_cache::instance() {
+    static decoded_image_cache cache;
+    return cache;
+}
+
+decoded_image_cache::decoded_image_cache()
+    : bytes_(0), max_bytes_(default_cache_bytes), hits_(0), misses_(0) {
+}
+
+static size_t image_bytes(image_rgba8 const& image) {
+    return (size_t) image.width() * image.height() * 4;
+}
+
+bool decoded_image_cache::enabled() const {
+    lock_guard<mutex> lock(mutex_);
+    return max_bytes_ > 0;
+}
+
+bool decoded_image_cache::fits(unsigned width, unsigned height) const {
+    lock_guard<mutex> lock(mutex_);
+    return (size_t) width * height * 4 <= max_bytes_ / 16;
+}
+
+bool decoded_image_cache::find(string const& key, entry& e) {
+    lock_guard<mutex> lock(mutex_);
+    unordered_map<string, lru_list::iterator>::iterator i = items_.find(key);
+    if (i == items_.end()) {
+        misses_++;
+        return false;
+    }
+    lru_.splice(lru_.begin(), lru_, i->second);
+    e = i->second->second;
+    hits_++;
+    return true;
+}
+
+void decoded_image_cache::insert(string const& key, entry const& e) {
+    lock_guard<mutex> lock(mutex_);
+    if (items_.count(key)) {
+        // decoded concurrently by another reader
+        return;
+    }
+    lru_.push_front(make_pair(key, e));
+    items_[key] = lru_.begin();
+    bytes_ += image_bytes(*e.image);
+    evict_();
+}
+
+void decoded_image_cache::evict_() {
+    while (bytes_ > max_bytes_) {
+        bytes_ -= image_bytes(*lru_.back().second.image);
+        items_.erase(lru_.back().first);
+        lru_.pop_back();
+    }
+}
+
+void decoded_image_cache::set_max_bytes(size_t max_bytes) {
+    lock_guard<mutex> lock(mutex_);
+    max_bytes_ = max_bytes;
+    evict_();
+}
+
+void decoded_image_cache::clear() {
+    lock_guard<mutex> lock(mutex_);
+    lru_.clear();
+    items_.clear();
+    bytes_ = 0;
+}
+
+decoded_image_cache::stats decoded_image_cache::get_stats() const {
+    lock_guard<mutex> lock(mutex_);
+    stats s;
+    s.hits = hits_;
+    s.misses = misses_;
+    s.bytes = bytes_;
+    s.images = lru_.size();
+    s.max_bytes = max_bytes_;
+    return s;
+}
+
+// Reads regions of an image from the decoded image cache.
+class decoded_image_reader : public image_reader {
+public:
+    decoded_image_reader(decoded_image_cache::entry const& e) : e_(e) {
+    }
+    unsigned width() const {
+        return e_.image->width();
+    }
+    unsigned height() const {
+        return e_.image->height();
+    }
+    bool has_alpha() const {
+        return e_.has_alpha;
+    }
+    boost::optional<box2d<double> > bounding_box() const {
+        return boost::optional<box2d<double> >(box2d<double>(0, 0, width() - 1, height() - 1));
+    }
+    void read(unsigned x, unsigned y, image_rgba8& image) {
+        if (x + image.width() > width() || y + image.height() > height()) {
+            throw image_reader_exception("png_reader: region outside of the image");
+        }
+        for (unsigned i = 0; i < image.height(); i++) {
+            image.set_row(i, e_.image->get_row(y + i) + x, image.width());
+        }
+    }
+    image_any read(unsigned x, unsigned y, unsigned width, unsigned height) {
+        image_rgba8 image(width, height);
+        read(x, y, image);
+        return image;
+    }
+
+private:
+    decoded_image_cache::entry e_;
+};
+
+// Returns a reader of the image cached under key. On a miss the image is
+// decoded with the reader that open returns and cached if it fits.
+template <typename Open>
+static image_reader *read_cached(string const& key, Open open) {
+    decoded_image_cache& cache = decoded_image_cache::instance();
+    decoded_image_cache::entry e;
+    if (cache.find(key, e)) {
+        return new decoded_image_reader(e);
+    }
+    unique_ptr<image_reader> r(open());
+    if (!cache.fits(r->width(), r->height())) {
+        return r.release();
+    }
+    shared_ptr<image_rgba8> image = make_shared<image_rgba8>(r->width(), r->height());
+    r->read(0, 0, *image);
+    e.image = image;
+    e.has_alpha = r->has_alpha();
+    cache.insert(key, e);
+    return new decoded_image_reader(e);
+}
+
+static image_reader *open_file(string const& file) {
+#if defined(MAPNIK_MEMORY_MAPPED_FILE)
+    // decode straight from the file's pages. The mapping is not added to the
+    // cache, it lives as long as the reader, so files that change are mapped
+    // afresh and tiled raster sources don't keep thousands of files mapped.
+    boost::optional<mapped_region_ptr> region = mapped_memory_cache::instance().find(file, false);
+    if (region) {
+        return new png_reader(*region);
+    }
+#endif
     return new png_reader(new ifstream(file, ios_base::binary));
 }
 
+image_reader *png_reader_for_file(string const &file) {
+    struct stat st;
+    if (!decoded_image_cache::instance().enabled() || stat(file.c_str(), &st) != 0) {
+        return open_file(file);
+    }
+    // a changed file is decoded again under its new modification time
+    char key[64];
+    snprintf(key, sizeof(key), "file:%lld:%lld:", (long long) st.st_mtime, (long long) st.st_size);
+    return read_cached(key + file, [&] { return open_file(file); });
+}
+
 image_reader *png_reader_for_bytes(char const* data, size_t size) {
-    string str(data, size);
-    return new png_reader(new istringstream(str));
+    // in-memory PNGs are mostly one-off raster data, and markers are cached
+    // decoded by Mapnik's marker_cache already
+    return new png_reader(data, size);
 }
 
 #endif // HAVE_PNG
@@ -7,10 +7,32 @@
 
 #include <png.h>
 #include <istream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
+#if defined(MAPNIK_MEMORY_MAPPED_FILE)
+#include <mapnik/mapped_memory_cache.hpp>
+#endif
+
+// Decodes PNG images into RGBA. The decoder keeps its state between reads, so
+// reading regions top to bottom decodes the image only once. Reading rows
+// above the last region restarts decoding.
 class png_reader : public mapnik::image_reader {
 public:
+    // Reads from input, which is deleted with the reader.
     png_reader(std::istream *input);
+    // Reads straight from the size bytes at data, which must stay valid for
+    // the lifetime of the reader.
+    png_reader(const char *data, size_t size);
+#if defined(MAPNIK_MEMORY_MAPPED_FILE)
+    // Reads from a mapped file, which is kept mapped for the lifetime of the
+    // reader.
+    png_reader(mapnik::mapped_region_ptr const& region);
+#endif
     ~png_reader();
     unsigned width() const;
     unsigned height() const;
@@ -20,15 +42,80 @@ public:
     mapnik::image_any read(unsigned x, unsigned y, unsigned width, unsigned height);
 
 private:
-    std::istream *input_;
+    std::istream *input_; // NULL when reading from memory
+    const char *data_;
+    size_t size_;
+    size_t pos_;
+#if defined(MAPNIK_MEMORY_MAPPED_FILE)
+    mapnik::mapped_region_ptr region_;
+#endif
+    png_structp pngp_;
+    png_infop infop_;
     unsigned height_;
     unsigned width_;
     bool has_alpha_;
     int depth_;
     int color_type_;
+    bool interlaced_;
+    unsigned next_row_; // row the decoder returns next
+    // whole image of interlaced PNGs, whose rows are only complete after
+    // decoding all passes
+    std::unique_ptr<mapnik::image_rgba8> decoded_;
+    std::vector<png_byte> row_; // a single decoded row of a region
 
-    void start_read_(png_structpp pngpp, png_infopp infopp);
+    void init_();
+    void start_read_();
+    void finish_read_();
+    void read_image_(mapnik::image_rgba8& image);
+    static void copy_region_(mapnik::image_rgba8 const& from, unsigned x, unsigned y, mapnik::image_rgba8& image);
     static void user_read_fn_(png_structp pngp, png_bytep datap, png_size_t length);
+    static void memory_read_fn_(png_structp pngp, png_bytep datap, png_size_t length);
+    static void user_error_fn_(png_structp pngp, png_const_charp msg);
+    static void user_warning_fn_(png_structp pngp, png_const_charp msg);
+};
+
+// Process-wide LRU cache of decoded images, bounded by their total size in
+// bytes. png_reader_for_file decodes each file it is asked for once and then
+// serves it from the cache. Safe for concurrent use.
+class decoded_image_cache {
+public:
+    struct entry {
+        std::shared_ptr<mapnik::image_rgba8 const> image;
+        bool has_alpha;
+    };
+    struct stats {
+        unsigned long long hits;
+        unsigned long long misses;
+        size_t bytes;
+        size_t images;
+        size_t max_bytes;
+    };
+
+    static decoded_image_cache& instance();
+    bool enabled() const;
+    // Whether images of the given size are cached. Larger images would evict
+    // most others, so they are read without the cache.
+    bool fits(unsigned width, unsigned height) const;
+    bool find(std::string const& key, entry& e);
+    void insert(std::string const& key, entry const& e);
+    // Evicts images until the cache holds at most max_bytes. 0 disables it.
+    void set_max_bytes(size_t max_bytes);
+    void clear();
+    stats get_stats() const;
+
+private:
+    typedef std::list<std::pair<std::string, entry> > lru_list;
+
+    decoded_image_cache();
+    void evict_();
+
+    mutable std::mutex mutex_;
+    lru_list lru_; // front is most recently used
+    std::unordered_map<std::string, lru_list::iterator> items_;
+    size_t bytes_;
+    size_t max_bytes_;
+    unsigned long long hits_;
+    unsigned long long misses_;
 };
 
 extern "C"
@@ -6,12 +6,42 @@ import (
 	"io/ioutil"
 	"log"
 	"os"
+	"sync"
 )
 
 type Generator struct {
 	MapFile string
 	TileDir string
 	Threads int
+	// Render blocks of MetaSize x MetaSize tiles at once if greater than 1
+	MetaSize uint64
+}
+
+// Tile files written for solid tiles by blob. Further solid tiles with the
+// same blob are written as hard links to the first file.
+type solidFiles struct {
+	sync.Mutex
+	paths map[string]string
+}
+
+func (f *solidFiles) write(path string, blob []byte, solid bool) {
+	// the file may be a link to other tiles from an earlier run, never write
+	// through it
+	os.Remove(path)
+	if solid {
+		f.Lock()
+		canonical, ok := f.paths[string(blob)]
+		if !ok && len(f.paths) < maxSolidSums {
+			f.paths[string(blob)] = path
+		}
+		f.Unlock()
+		if ok {
+			if os.Link(canonical, path) == nil {
+				return
+			}
+		}
+	}
+	ioutil.WriteFile(path, blob, 0644)
 }
 
 func ensureDirExists(path string) {
@@ -30,30 +60,48 @@ func (g *Generator) Run(lowLeft, upRight mapnik.Coord, minZ, maxZ uint64, name s
 
 	ensureDirExists(g.TileDir)
 
+	n := g.MetaSize
+	if n < 1 {
+		n = 1
+	}
+	files := &solidFiles{paths: make(map[string]string)}
+
+	ll0 := [2]float64{lowLeft.X, upRight.Y}
+	ll1 := [2]float64{upRight.X, lowLeft.Y}
+	// first and last tile of each zoom level
+	bounds := make(map[uint64][2]TileCoord)
+	for z := minZ; z <= maxZ; z++ {
+		px0 := fromLLtoPixel(ll0, z)
+		px1 := fromLLtoPixel(ll1, z)
+		bounds[z] = [2]TileCoord{
+			{X: uint64(px0[0] / 256.0), Y: uint64(px0[1] / 256.0), Zoom: z},
+			{X: uint64(px1[0] / 256.0), Y: uint64(px1[1] / 256.0), Zoom: z},
+		}
+	}
+
 	for i := 0; i < g.Threads; i++ {
+		if n > 1 {
+			go g.renderMetatiles(c, n, bounds, files, q)
+			continue
+		}
 		go func(id int, ctc <-chan TileCoord, q chan bool) {
 			requests := NewTileRendererChan(g.MapFile)
 			results := make(chan TileFetchResult)
 			for t := range ctc {
 				requests <- TileFetchRequest{t, results}
 				r := <-results
-				ioutil.WriteFile(r.Coord.OSMFilename(), r.BlobPNG, 0644)
+				files.write(r.Coord.OSMFilename(), r.BlobPNG, r.Solid)
 			}
 			q <- true
 		}(i, c, q)
 	}
 
-	ll0 := [2]float64{lowLeft.X, upRight.Y}
-	ll1 := [2]float64{upRight.X, lowLeft.Y}
-
 	for z := minZ; z <= maxZ; z++ {
-		px0 := fromLLtoPixel(ll0, z)
-		px1 := fromLLtoPixel(ll1, z)
-
+		b := bounds[z]
 		ensureDirExists(fmt.Sprintf("%d", z))
-		for x := uint64(px0[0] / 256.0); x <= uint64(px1[0]/256.0); x++ {
+		for x := b[0].X / n * n; x <= b[1].X; x += n {
 			ensureDirExists(fmt.Sprintf("%d/%d", z, x))
-			for y := uint64(px0[1] / 256.0); y <= uint64(px1[1]/256.0); y++ {
+			for y := b[0].Y / n * n; y <= b[1].Y; y += n {
 				c <- TileCoord{x, y, z, false, ""}
 			}
 		}
@@ -63,3 +111,26 @@ func (g *Generator) Run(lowLeft, upRight mapnik.Coord, minZ, maxZ uint64, name s
 		<-q
 	}
 }
+
+// Renders the metatiles with the upper left tiles received from ctc and
+// writes their tiles that lie within bounds.
+func (g *Generator) renderMetatiles(ctc <-chan TileCoord, n uint64, bounds map[uint64][2]TileCoord, files *solidFiles, q chan<- bool) {
+	t := NewTileRenderer(g.MapFile)
+	for mt := range ctc {
+		tiles, solid, err := t.RenderMetatileZXY(mt.Zoom, mt.X, mt.Y, uint(n))
+		if err != nil {
+			log.Println("Error while rendering metatile", mt, ":", err.Error())
+			continue
+		}
+		b := bounds[mt.Zoom]
+		for i, blob := range tiles {
+			tc := TileCoord{mt.X + uint64(i)%n, mt.Y + uint64(i)/n, mt.Zoom, false, ""}
+			if blob == nil || tc.X < b[0].X || tc.X > b[1].X || tc.Y < b[0].Y || tc.Y > b[1].Y {
+				continue
+			}
+			ensureDirExists(fmt.Sprintf("%d/%d", tc.Zoom, tc.X))
+			files.write(tc.OSMFilename(), blob, solid[i])
+		}
+	}
+	q <- true
+}
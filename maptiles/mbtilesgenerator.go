@@ -3,8 +3,13 @@ package maptiles
 import (
 	"crypto/md5"
 	"database/sql"
+	"encoding/hex"
 	"fmt"
 	"log"
+	"net/url"
+	"runtime"
+	"sync"
+	"time"
 
 	_ "github.com/mattn/go-sqlite3"
 	//"net/http"
@@ -13,14 +18,57 @@ import (
 
 // MBTiles 1.2-compatible Tile Db with multi-layer support.
 // Was named Mbtiles before, hence the use of *m in methods.
+//
+// The db is kept in WAL mode so that fetches run in parallel on a pool of
+// read-only connections while a single writer inserts new tiles.
 type TileDb struct {
-	db          *sql.DB
+	db          *sql.DB // the writer connection
+	rdb         *sql.DB // pool of read-only connections
+	fetchStmt   *sql.Stmt
+	insertStmts [3]*sql.Stmt // test for a blob, insert a blob, insert a tile
+	readers     int
 	requestChan chan TileFetchRequest
 	insertChan  chan TileFetchResult
 	layerIds    map[string]int
+	newLayers   map[string]int    // layers added by the insert batch in progress
+	solidSums   map[string][]byte // checksums of stored solid tiles by blob
 	qc          chan bool
 }
 
+// Inserted tiles are committed in one transaction per batch of up to
+// insertBatchSize tiles, or once insertFlushInterval has passed since the
+// first tile of the batch was queued.
+const (
+	insertBatchSize     = 512
+	insertFlushInterval = 250 * time.Millisecond
+)
+
+// Version of the cache db schema, kept in PRAGMA user_version. Version 0 keyed
+// tile blobs by unindexed hex md5 strings, version 1 by binary md5 sums with a
+// primary key index.
+const schemaVersion = 1
+
+// Number of distinct solid tiles whose checksums are remembered. Solid tiles
+// share canonical blobs, so only a handful of them occur in practice.
+const maxSolidSums = 1024
+
+const (
+	createLayeredTiles = "CREATE TABLE IF NOT EXISTS layered_tiles (layer_id integer, zoom_level integer, tile_column integer, tile_row integer, checksum blob, PRIMARY KEY (layer_id, zoom_level, tile_column, tile_row) FOREIGN KEY(checksum) REFERENCES tile_blobs(checksum))"
+	createTileBlobs    = "CREATE TABLE IF NOT EXISTS tile_blobs (checksum blob PRIMARY KEY NOT NULL, tile_data blob)"
+)
+
+const fetchQuery = `
+	SELECT tile_data 
+	FROM tile_blobs 
+	WHERE checksum=(
+		SELECT checksum 
+		FROM layered_tiles 
+		WHERE zoom_level=? 
+			AND tile_column=? 
+			AND tile_row=?
+			AND layer_id=(SELECT rowid FROM layers WHERE layer_name=?)
+	)`
+
 func NewTileDb(path string) *TileDb {
 	m := TileDb{}
 	var err error
@@ -29,12 +77,17 @@ func NewTileDb(path string) *TileDb {
 		log.Println("Error opening db", err.Error())
 		return nil
 	}
+	m.db.SetMaxOpenConns(1)
+	if err = m.migrate(); err != nil {
+		log.Println("Error migrating db", err.Error())
+		return nil
+	}
 	queries := []string{
-		"PRAGMA journal_mode = OFF",
+		"PRAGMA journal_mode = WAL",
 		"CREATE TABLE IF NOT EXISTS layers(layer_name text PRIMARY KEY NOT NULL)",
 		"CREATE TABLE IF NOT EXISTS metadata (name text PRIMARY KEY NOT NULL, value text NOT NULL)",
-		"CREATE TABLE IF NOT EXISTS layered_tiles (layer_id integer, zoom_level integer, tile_column integer, tile_row integer, checksum text, PRIMARY KEY (layer_id, zoom_level, tile_column, tile_row) FOREIGN KEY(checksum) REFERENCES tile_blobs(checksum))",
-		"CREATE TABLE IF NOT EXISTS tile_blobs (checksum text, tile_data blob)",
+		createLayeredTiles,
+		createTileBlobs,
 		"CREATE VIEW IF NOT EXISTS tiles AS SELECT layered_tiles.zoom_level as zoom_level, layered_tiles.tile_column as tile_column, layered_tiles.tile_row as tile_row, (SELECT tile_data FROM tile_blobs WHERE checksum=layered_tiles.checksum) as tile_data FROM layered_tiles WHERE layered_tiles.layer_id = (SELECT rowid FROM layers WHERE layer_name='default')",
 		"REPLACE INTO metadata VALUES('name', 'go-mapnik cache file')",
 		"REPLACE INTO metadata VALUES('type', 'overlay')",
@@ -55,12 +108,134 @@ func NewTileDb(path string) *TileDb {
 
 	m.readLayers()
 
+	writes := []struct {
+		stmt  **sql.Stmt
+		query string
+	}{
+		{&m.insertStmts[0], "SELECT 1 FROM tile_blobs WHERE checksum=?"},
+		{&m.insertStmts[1], "REPLACE INTO tile_blobs VALUES(?,?)"},
+		{&m.insertStmts[2], "REPLACE INTO layered_tiles VALUES(?, ?, ?, ?, ?)"},
+	}
+	for _, w := range writes {
+		if *w.stmt, err = m.db.Prepare(w.query); err != nil {
+			log.Println("Error preparing insert", err.Error())
+			return nil
+		}
+	}
+
+	m.readers = runtime.NumCPU()
+	// SQLite decodes %-escapes in URI paths, so ?, # and % in path survive
+	m.rdb, err = sql.Open("sqlite3", "file:"+url.PathEscape(path)+"?mode=ro")
+	if err != nil {
+		log.Println("Error opening db for reading", err.Error())
+		return nil
+	}
+	m.rdb.SetMaxOpenConns(m.readers)
+	m.rdb.SetMaxIdleConns(m.readers)
+	if m.fetchStmt, err = m.rdb.Prepare(fetchQuery); err != nil {
+		log.Println("Error preparing fetch", err.Error())
+		return nil
+	}
+
+	m.solidSums = make(map[string][]byte)
 	m.insertChan = make(chan TileFetchResult)
-	m.requestChan = make(chan TileFetchRequest)
+	m.requestChan = make(chan TileFetchRequest, 4*m.readers)
+	m.qc = make(chan bool)
 	go m.Run()
 	return &m
 }
 
+// Brings cache files written with an older schema up to schemaVersion.
+func (m *TileDb) migrate() error {
+	var version, tables int
+	if err := m.db.QueryRow("PRAGMA user_version").Scan(&version); err != nil {
+		return err
+	}
+	if version >= schemaVersion {
+		return nil
+	}
+	setVersion := fmt.Sprintf("PRAGMA user_version = %d", schemaVersion)
+	err := m.db.QueryRow("SELECT count(*) FROM sqlite_master WHERE type='table' AND name='tile_blobs'").Scan(&tables)
+	if err != nil {
+		return err
+	}
+	if tables == 0 {
+		// new file, the current schema is created by NewTileDb
+		_, err = m.db.Exec(setVersion)
+		return err
+	}
+
+	log.Println("Migrating cache db to schema version", schemaVersion)
+	tx, err := m.db.Begin()
+	if err != nil {
+		return err
+	}
+	defer tx.Rollback()
+	queries := []string{
+		"DROP VIEW IF EXISTS tiles",
+		"ALTER TABLE tile_blobs RENAME TO tile_blobs_v0",
+		"ALTER TABLE layered_tiles RENAME TO layered_tiles_v0",
+		createTileBlobs,
+		createLayeredTiles,
+	}
+	for _, query := range queries {
+		if _, err = tx.Exec(query); err != nil {
+			return err
+		}
+	}
+	err = copyRows(tx, "SELECT checksum, tile_data FROM tile_blobs_v0",
+		"INSERT OR IGNORE INTO tile_blobs VALUES(?, ?)", 2)
+	if err != nil {
+		return err
+	}
+	err = copyRows(tx, "SELECT checksum, layer_id, zoom_level, tile_column, tile_row FROM layered_tiles_v0",
+		"REPLACE INTO layered_tiles(checksum, layer_id, zoom_level, tile_column, tile_row) VALUES(?, ?, ?, ?, ?)", 5)
+	if err != nil {
+		return err
+	}
+	for _, query := range []string{"DROP TABLE layered_tiles_v0", "DROP TABLE tile_blobs_v0", setVersion} {
+		if _, err = tx.Exec(query); err != nil {
+			return err
+		}
+	}
+	return tx.Commit()
+}
+
+// Copies the rows selected by query into insert, converting the hex checksum
+// in the first column to binary.
+func copyRows(tx *sql.Tx, query, insert string, columns int) error {
+	rows, err := tx.Query(query)
+	if err != nil {
+		return err
+	}
+	defer rows.Close()
+	stmt, err := tx.Prepare(insert)
+	if err != nil {
+		return err
+	}
+	defer stmt.Close()
+
+	var checksum string
+	values := make([]interface{}, columns)
+	dest := make([]interface{}, columns)
+	dest[0] = &checksum
+	for i := 1; i < columns; i++ {
+		dest[i] = &values[i]
+	}
+	for rows.Next() {
+		if err = rows.Scan(dest...); err != nil {
+			return err
+		}
+		if values[0], err = hex.DecodeString(checksum); err != nil {
+			return err
+		}
+		if _, err = stmt.Exec(values...); err != nil {
+			return err
+		}
+	}
+	return rows.Err()
+}
+
 func (m *TileDb) readLayers() {
 	m.layerIds = make(map[string]int)
 	rows, err := m.db.Query("SELECT rowid, layer_name FROM layers")
@@ -80,20 +255,37 @@ func (m *TileDb) readLayers() {
 	}
 }
 
-func (m *TileDb) ensureLayer(layer string) {
-	if _, ok := m.layerIds[layer]; !ok {
-		if _, err := m.db.Exec("INSERT OR IGNORE INTO layers(layer_name) VALUES(?)", layer); err != nil {
-			log.Println(err)
-		}
-		m.readLayers()
+// Returns the id of layer, adding the layer in tx if it is new. The ids of
+// added layers only become known in layerIds once tx commits.
+func (m *TileDb) layerId(tx *sql.Tx, layer string) (int, bool) {
+	if id, ok := m.layerIds[layer]; ok {
+		return id, true
+	}
+	if id, ok := m.newLayers[layer]; ok {
+		return id, true
 	}
+	if _, err := tx.Exec("INSERT OR IGNORE INTO layers(layer_name) VALUES(?)", layer); err != nil {
+		log.Println(err)
+	}
+	var id int
+	if err := tx.QueryRow("SELECT rowid FROM layers WHERE layer_name=?", layer).Scan(&id); err != nil {
+		log.Println(err)
+		return 0, false
+	}
+	m.newLayers[layer] = id
+	return id, true
 }
 
 func (m *TileDb) Close() {
 	close(m.insertChan)
 	close(m.requestChan)
-	if m.qc != nil {
-		<-m.qc // block until channel qc is closed (meaning Run() is finished)
+	<-m.qc // block until channel qc is closed (meaning Run() is finished)
+	m.fetchStmt.Close()
+	for _, stmt := range m.insertStmts {
+		stmt.Close()
+	}
+	if err := m.rdb.Close(); err != nil {
+		log.Print(err)
 	}
 	if err := m.db.Close(); err != nil {
 		log.Print(err)
@@ -101,6 +293,14 @@ func (m *TileDb) Close() {
 
 }
 
+// Records name (png, jpg or webp) as the format of the default layer's tiles
+// in the metadata.
+func (m *TileDb) SetFormat(name string) {
+	if _, err := m.db.Exec("REPLACE INTO metadata VALUES('format', ?)", name); err != nil {
+		log.Println("Error setting format", err.Error())
+	}
+}
+
 func (m TileDb) InsertQueue() chan<- TileFetchResult {
 	return m.insertChan
 }
@@ -109,53 +309,142 @@ func (m TileDb) RequestQueue() chan<- TileFetchRequest {
 	return m.requestChan
 }
 
-// Best executed in a dedicated go routine.
+// Returns the number of fetch requests waiting for a reader.
+func (m *TileDb) QueueDepth() int {
+	return len(m.requestChan)
+}
+
+// Serves fetch requests on one goroutine per read connection and inserts
+// on the calling one until Close is called. Started by NewTileDb.
 func (m *TileDb) Run() {
-	m.qc = make(chan bool)
+	var wg sync.WaitGroup
+	for i := 0; i < m.readers; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for r := range m.requestChan {
+				m.fetch(r)
+			}
+		}()
+	}
+	m.runInserts()
+	wg.Wait()
+	close(m.qc)
+}
+
+// Collects queued tiles into batches until the insert queue is closed.
+func (m *TileDb) runInserts() {
+	batch := make([]TileFetchResult, 0, insertBatchSize)
+	var flush <-chan time.Time
 	for {
 		select {
-		case r := <-m.requestChan:
-			m.fetch(r)
-		case i := <-m.insertChan:
-			m.insert(i)
+		case i, ok := <-m.insertChan:
+			if !ok {
+				m.insertBatch(batch)
+				return
+			}
+			batch = append(batch, i)
+			if len(batch) == 1 {
+				flush = time.After(insertFlushInterval)
+			}
+			if len(batch) < insertBatchSize {
+				continue
+			}
+		case <-flush:
+		}
+		m.insertBatch(batch)
+		batch = batch[:0]
+		flush = nil
+	}
+}
+
+func (m *TileDb) insertBatch(batch []TileFetchResult) {
+	if len(batch) == 0 {
+		return
+	}
+	defer func() {
+		for _, i := range batch {
+			if i.Committed != nil {
+				i.Committed()
+			}
 		}
+	}()
+	tx, err := m.db.Begin()
+	if err != nil {
+		log.Println("error starting insert", err)
+		return
+	}
+	var stmts [3]*sql.Stmt
+	for k, stmt := range m.insertStmts {
+		stmts[k] = tx.Stmt(stmt)
+	}
+	m.newLayers = make(map[string]int)
+	for _, i := range batch {
+		m.insert(tx, stmts, i)
+	}
+	if err = tx.Commit(); err != nil {
+		log.Println("error committing inserts", err)
+		// the remembered blobs may not have been stored
+		m.solidSums = make(map[string][]byte)
+		return
+	}
+	for layer, id := range m.newLayers {
+		m.layerIds[layer] = id
 	}
-	m.qc <- true
 }
 
-func (m *TileDb) insert(i TileFetchResult) {
+func (m *TileDb) insert(tx *sql.Tx, stmts [3]*sql.Stmt, i TileFetchResult) {
 	i.Coord.setTMS(true)
 	x, y, z, l := i.Coord.X, i.Coord.Y, i.Coord.Zoom, i.Coord.Layer
 	if l == "" {
 		l = "default"
 	}
+	var s []byte
+	if i.Solid {
+		// solid tiles share canonical blobs, so only reference the stored one
+		s = m.solidSums[string(i.BlobPNG)]
+	}
+	if s == nil {
+		var err error
+		if s, err = insertBlob(stmts, i.BlobPNG); err != nil {
+			log.Println(err)
+			return
+		}
+		if i.Solid && len(m.solidSums) < maxSolidSums {
+			m.solidSums[string(i.BlobPNG)] = s
+		}
+	}
+	id, ok := m.layerId(tx, l)
+	if !ok {
+		return
+	}
+	if _, err := stmts[2].Exec(id, z, x, y, s); err != nil {
+		log.Println(err)
+	}
+}
+
+// Stores blob unless it is already present and returns its checksum.
+func insertBlob(stmts [3]*sql.Stmt, blob []byte) ([]byte, error) {
 	h := md5.New()
-	_, err := h.Write(i.BlobPNG)
+	_, err := h.Write(blob)
 	if err != nil {
-		log.Println(err)
-		return
+		return nil, err
 	}
-	s := fmt.Sprintf("%x", h.Sum(nil))
-	row := m.db.QueryRow("SELECT 1 FROM tile_blobs WHERE checksum=?", s)
+	s := h.Sum(nil)
+	row := stmts[0].QueryRow(s)
 	var dummy uint64
 	err = row.Scan(&dummy)
 	switch {
 	case err == sql.ErrNoRows:
-		if _, err = m.db.Exec("REPLACE INTO tile_blobs VALUES(?,?)", s, i.BlobPNG); err != nil {
-			log.Println("error during insert", err)
-			return
+		if _, err = stmts[1].Exec(s, blob); err != nil {
+			return nil, fmt.Errorf("error during insert %v", err)
 		}
 	case err != nil:
-		log.Println("error during test", err)
-		return
+		return nil, fmt.Errorf("error during test %v", err)
 	default:
 		//log.Println("Reusing blob", s)
 	}
-	m.ensureLayer(l)
-	sql := "REPLACE INTO layered_tiles VALUES(?, ?, ?, ?, ?)"
-	if _, err = m.db.Exec(sql, m.layerIds[l], z, x, y, s); err != nil {
-		log.Println(err)
-	}
+	return s, nil
 }
 
 func (m *TileDb) fetch(r TileFetchRequest) {
@@ -164,20 +453,9 @@ func (m *TileDb) fetch(r TileFetchRequest) {
 	if l == "" {
 		l = "default"
 	}
-	result := TileFetchResult{r.Coord, nil}
-	queryString := `
-		SELECT tile_data 
-		FROM tile_blobs 
-		WHERE checksum=(
-			SELECT checksum 
-			FROM layered_tiles 
-			WHERE zoom_level=? 
-				AND tile_column=? 
-				AND tile_row=?
-				AND layer_id=(SELECT rowid FROM layers WHERE layer_name=?)
-		)`
+	result := TileFetchResult{Coord: r.Coord}
 	var blob []byte
-	row := m.db.QueryRow(queryString, zoom, x, y, l)
+	row := m.fetchStmt.QueryRow(zoom, x, y, l)
 	err := row.Scan(&blob)
 	switch {
 	case err == sql.ErrNoRows:
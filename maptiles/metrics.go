@@ -0,0 +1,161 @@
+package maptiles
+
+import (
+	"bufio"
+	"fmt"
+	"io"
+	"math"
+	"sort"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/fawick/go-mapnik/mapnik"
+)
+
+// Upper bounds in seconds of the latency histogram buckets
+var latencyBuckets = [...]float64{.001, .0025, .005, .01, .025, .05, .1, .25, .5, 1, 2.5, 5, 10}
+
+// Latency histogram with fixed buckets, safe for concurrent use.
+type histogram struct {
+	counts [len(latencyBuckets) + 1]uint64 // the last bucket is +Inf
+	sum    uint64                          // nanoseconds
+}
+
+func (h *histogram) observe(d time.Duration) {
+	s := d.Seconds()
+	i := sort.SearchFloat64s(latencyBuckets[:], s)
+	atomic.AddUint64(&h.counts[i], 1)
+	atomic.AddUint64(&h.sum, uint64(d))
+}
+
+func (h *histogram) write(w io.Writer, name, help string) {
+	fmt.Fprintf(w, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name)
+	var n uint64
+	for i := range h.counts {
+		n += atomic.LoadUint64(&h.counts[i])
+		le := math.Inf(1)
+		if i < len(latencyBuckets) {
+			le = latencyBuckets[i]
+		}
+		fmt.Fprintf(w, "%s_bucket{le=\"%g\"} %d\n", name, le, n)
+	}
+	fmt.Fprintf(w, "%s_sum %g\n", name, time.Duration(atomic.LoadUint64(&h.sum)).Seconds())
+	fmt.Fprintf(w, "%s_count %d\n", name, n)
+}
+
+// Render counters of a single layer
+type layerMetrics struct {
+	renders, failures uint64
+	nanos             uint64
+}
+
+// Counters and histograms of a TileServer, see TileServer.ServeMetrics. They
+// are all 64-bit words used with atomic ops, which need the struct itself to
+// be 64-bit aligned, see TileServer.
+type serverMetrics struct {
+	render, encode, fetch histogram
+
+	requests, dbHits, dbMisses, bytesServed uint64
+
+	mu     sync.Mutex
+	layers map[string]*layerMetrics
+}
+
+func (m *serverMetrics) layer(name string) *layerMetrics {
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	if m.layers == nil {
+		m.layers = make(map[string]*layerMetrics)
+	}
+	l, ok := m.layers[name]
+	if !ok {
+		l = new(layerMetrics)
+		m.layers[name] = l
+	}
+	return l
+}
+
+// Records a render of the given layer that took d including the time queued.
+func (m *serverMetrics) observeRender(layer string, d time.Duration, r TileFetchResult) {
+	m.render.observe(d)
+	if r.Stats != nil {
+		m.encode.observe(r.Stats.Encode)
+	}
+	l := m.layer(layer)
+	atomic.AddUint64(&l.renders, 1)
+	atomic.AddUint64(&l.nanos, uint64(d))
+	if r.BlobPNG == nil {
+		atomic.AddUint64(&l.failures, 1)
+	}
+}
+
+func writeCounter(w io.Writer, name, help string, v uint64) {
+	fmt.Fprintf(w, "# HELP %s %s\n# TYPE %s counter\n%s %d\n", name, help, name, name, v)
+}
+
+func writeGauge(w io.Writer, name, help string, v int) {
+	fmt.Fprintf(w, "# HELP %s %s\n# TYPE %s gauge\n%s %d\n", name, help, name, name, v)
+}
+
+// Writes the metrics in the Prometheus text exposition format.
+func (t *TileServer) writeMetrics(out io.Writer) error {
+	w := bufio.NewWriter(out)
+	m := &t.metrics
+
+	writeCounter(w, "maptiles_requests_total", "Tile requests served.", atomic.LoadUint64(&m.requests))
+	writeCounter(w, "maptiles_served_bytes_total", "Bytes of tile data served.", atomic.LoadUint64(&m.bytesServed))
+	if t.MemCache != nil {
+		hits, misses := t.MemCache.Stats()
+		writeCounter(w, "maptiles_memcache_hits_total", "Tiles found in the in-memory cache.", hits)
+		writeCounter(w, "maptiles_memcache_misses_total", "Tiles not found in the in-memory cache.", misses)
+	}
+	writeCounter(w, "maptiles_db_hits_total", "Tiles found in the cache db.", atomic.LoadUint64(&m.dbHits))
+	writeCounter(w, "maptiles_db_misses_total", "Tiles not found in the cache db.", atomic.LoadUint64(&m.dbMisses))
+	writeGauge(w, "maptiles_db_queue_depth", "Fetch requests waiting for a cache db reader.", t.m.QueueDepth())
+	images := mapnik.ImageCache()
+	writeCounter(w, "maptiles_image_cache_hits_total", "Images found decoded in the image cache.", images.Hits)
+	writeCounter(w, "maptiles_image_cache_misses_total", "Images decoded for the image cache.", images.Misses)
+	writeGauge(w, "maptiles_image_cache_bytes", "Size of the decoded images in the image cache.", images.Bytes)
+
+	m.fetch.write(w, "maptiles_db_fetch_seconds", "Time to fetch a tile from the cache db.")
+	m.render.write(w, "maptiles_render_seconds", "Time to render a tile, including the time queued.")
+	m.encode.write(w, "maptiles_encode_seconds", "Time to encode a rendered tile, if TileServer.RenderStats is set.")
+
+	m.mu.Lock()
+	names := make([]string, 0, len(m.layers))
+	layers := make([]*layerMetrics, 0, len(m.layers))
+	for name := range m.layers {
+		names = append(names, name)
+	}
+	sort.Strings(names)
+	for _, name := range names {
+		layers = append(layers, m.layers[name])
+	}
+	m.mu.Unlock()
+
+	fmt.Fprintf(w, "# HELP maptiles_layer_renders_total Tiles rendered per layer.\n# TYPE maptiles_layer_renders_total counter\n")
+	for i, l := range layers {
+		fmt.Fprintf(w, "maptiles_layer_renders_total{layer=%q} %d\n", names[i], atomic.LoadUint64(&l.renders))
+	}
+	fmt.Fprintf(w, "# HELP maptiles_layer_render_failures_total Tiles that could not be rendered per layer.\n# TYPE maptiles_layer_render_failures_total counter\n")
+	for i, l := range layers {
+		fmt.Fprintf(w, "maptiles_layer_render_failures_total{layer=%q} %d\n", names[i], atomic.LoadUint64(&l.failures))
+	}
+	fmt.Fprintf(w, "# HELP maptiles_layer_render_seconds_total Time spent rendering tiles per layer.\n# TYPE maptiles_layer_render_seconds_total counter\n")
+	for i, l := range layers {
+		fmt.Fprintf(w, "maptiles_layer_render_seconds_total{layer=%q} %g\n", names[i], time.Duration(atomic.LoadUint64(&l.nanos)).Seconds())
+	}
+
+	depths := t.lmp.QueueDepths()
+	names = names[:0]
+	for name := range depths {
+		names = append(names, name)
+	}
+	sort.Strings(names)
+	fmt.Fprintf(w, "# HELP maptiles_render_queue_depth Render requests waiting for a renderer per layer.\n# TYPE maptiles_render_queue_depth gauge\n")
+	for _, name := range names {
+		fmt.Fprintf(w, "maptiles_render_queue_depth{layer=%q} %d\n", name, depths[name])
+	}
+	return w.Flush()
+}
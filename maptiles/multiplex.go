@@ -6,6 +6,12 @@ import (
 
 type LayerMultiplex struct {
 	layerChans map[string]chan<- TileFetchRequest
+	// Render goroutines per layer added with AddRenderer(Format), and the
+	// number of requests queued per layer before SubmitRequest blocks
+	Workers, QueueSize int
+	// Collect render statistics for layers added with AddRenderer(Format),
+	// see TileFetchResult.Stats
+	RenderStats bool
 }
 
 func NewLayerMultiplex() *LayerMultiplex {
@@ -23,13 +29,26 @@ func DefaultRenderMultiplex(defaultStylesheet string) *LayerMultiplex {
 }
 
 func (l *LayerMultiplex) AddRenderer(name string, stylesheet string) {
-	l.layerChans[name] = NewTileRendererChan(stylesheet)
+	l.AddRendererFormat(name, stylesheet, DefaultFormat)
+}
+
+func (l *LayerMultiplex) AddRendererFormat(name, stylesheet, format string) {
+	l.layerChans[name] = NewTileRendererPool(stylesheet, format, l.Workers, l.QueueSize, l.RenderStats)
 }
 
 func (l *LayerMultiplex) AddSource(name string, fetchChan chan<- TileFetchRequest) {
 	l.layerChans[name] = fetchChan
 }
 
+// Returns the number of requests waiting for a renderer per layer.
+func (l *LayerMultiplex) QueueDepths() map[string]int {
+	depths := make(map[string]int, len(l.layerChans))
+	for name, c := range l.layerChans {
+		depths[name] = len(c)
+	}
+	return depths
+}
+
 func (l LayerMultiplex) SubmitRequest(r TileFetchRequest) bool {
 	c, ok := l.layerChans[r.Coord.Layer]
 	if ok {
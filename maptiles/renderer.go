@@ -3,6 +3,10 @@ package maptiles
 import (
 	"fmt"
 	"log"
+	"os"
+	"strings"
+	"sync"
+	"time"
 
 	"github.com/fawick/go-mapnik/mapnik"
 )
@@ -20,6 +24,15 @@ func (c TileCoord) OSMFilename() string {
 type TileFetchResult struct {
 	Coord   TileCoord
 	BlobPNG []byte
+	// The tile has a single color and BlobPNG is the canonical encoding
+	// shared by all tiles of that color
+	Solid bool
+	// Statistics of rendering the tile, if it was rendered by a renderer
+	// pool
+	Stats *mapnik.RenderStats
+	// If not nil, called by TileDb once the batch containing the tile is
+	// committed to the cache db, or failed to commit
+	Committed func()
 }
 
 type TileFetchRequest struct {
@@ -34,48 +47,144 @@ func (c *TileCoord) setTMS(tms bool) {
 	}
 }
 
+// Format tiles are encoded in unless configured otherwise
+const DefaultFormat = "png256"
+
+// Returns the file extension of tiles encoded in the given Mapnik format,
+// which is also its MBTiles format name.
+func formatExtension(format string) string {
+	switch {
+	case strings.HasPrefix(format, "jpeg"):
+		return "jpg"
+	case strings.HasPrefix(format, "webp"):
+		return "webp"
+	}
+	return "png"
+}
+
 func NewTileRendererChan(stylesheet string) chan<- TileFetchRequest {
-	c := make(chan TileFetchRequest)
-
-	go func(requestChan <-chan TileFetchRequest) {
-		var err error
-		t := NewTileRenderer(stylesheet)
-		for request := range requestChan {
-			result := TileFetchResult{request.Coord, nil}
-			result.BlobPNG, err = t.RenderTile(request.Coord)
-			if err != nil {
-				log.Println("Error while rendering", request.Coord, ":", err.Error())
-				result.BlobPNG = nil
+	return NewTileRendererChanFormat(stylesheet, DefaultFormat)
+}
+
+// Like NewTileRendererChan, but tiles are encoded in the given Mapnik format,
+// see mapnik.Map.RenderToMemory.
+func NewTileRendererChanFormat(stylesheet, format string) chan<- TileFetchRequest {
+	return NewTileRendererPool(stylesheet, format, 1, 0, false)
+}
+
+// Starts workers goroutines that render the requests sent to the returned
+// channel, each one on its own clone of the stylesheet's map. Up to queueSize
+// requests are buffered, after that senders block until a worker is free.
+// If stats is set, the results carry the statistics of each render.
+func NewTileRendererPool(stylesheet, format string, workers, queueSize int, stats bool) chan<- TileFetchRequest {
+	if workers < 1 {
+		workers = 1
+	}
+	c := make(chan TileFetchRequest, queueSize)
+
+	for i := 0; i < workers; i++ {
+		go func(requestChan <-chan TileFetchRequest) {
+			var err error
+			t := NewTileRenderer(stylesheet)
+			t.Format = format
+			if t.err == nil {
+				t.m.SetRenderStats(stats)
 			}
-			request.OutChan <- result
-		}
-	}(c)
+			for request := range requestChan {
+				result := TileFetchResult{Coord: request.Coord}
+				result.BlobPNG, result.Solid, err = t.renderTile(request.Coord)
+				if t.err == nil {
+					result.Stats = t.m.RenderStats()
+				}
+				if err != nil {
+					log.Println("Error while rendering", request.Coord, ":", err.Error())
+					result.BlobPNG = nil
+				}
+				request.OutChan <- result
+			}
+		}(c)
+	}
 
 	return c
 }
 
 // Renders images as Web Mercator tiles
 type TileRenderer struct {
-	m  *mapnik.Map
-	mp mapnik.Projection
+	m   *mapnik.Map
+	err error // the stylesheet could not be loaded
+	// Mapnik format string of the rendered tiles, e.g. "png256" or "jpeg80"
+	Format string
+}
+
+// A stylesheet loaded at its modification time mtime, or the error loading it
+type prototype struct {
+	m     *mapnik.Map
+	mtime time.Time
+	err   error
+}
+
+// Loaded maps per stylesheet. Each stylesheet is parsed only once per
+// modification, renderers work on clones of the loaded map which share its
+// datasources.
+var prototypes = struct {
+	sync.Mutex
+	maps map[string]*prototype
+}{maps: make(map[string]*prototype)}
+
+func loadMap(stylesheet string) (*mapnik.Map, error) {
+	var mtime time.Time
+	if fi, err := os.Stat(stylesheet); err == nil {
+		mtime = fi.ModTime()
+	}
+	prototypes.Lock()
+	defer prototypes.Unlock()
+	p, ok := prototypes.maps[stylesheet]
+	if !ok || !p.mtime.Equal(mtime) {
+		if ok && p.m != nil {
+			// clones are independent of the map they were cloned from
+			p.m.Free()
+		}
+		p = &prototype{m: mapnik.NewMap(256, 256), mtime: mtime}
+		if p.err = p.m.Load(stylesheet); p.err != nil {
+			log.Println("Error loading", stylesheet, ":", p.err.Error())
+			p.m.Free()
+			p.m = nil
+		}
+		prototypes.maps[stylesheet] = p
+	}
+	if p.err != nil {
+		return nil, p.err
+	}
+	return p.m.Clone(), nil
 }
 
+// Creates a renderer of the stylesheet. If it cannot be loaded, rendering
+// returns the error. Renderers keep the map they were created with, a
+// stylesheet that changed on disk is only loaded again for renderers created
+// afterwards.
 func NewTileRenderer(stylesheet string) *TileRenderer {
 	t := new(TileRenderer)
-	var err error
-	if err != nil {
-		log.Fatal(err)
-	}
-	t.m = mapnik.NewMap(256, 256)
-	t.m.Load(stylesheet)
-	t.mp = t.m.Projection()
+	t.m, t.err = loadMap(stylesheet)
+	t.Format = DefaultFormat
 
 	return t
 }
 
 func (t *TileRenderer) RenderTile(c TileCoord) ([]byte, error) {
+	blob, _, err := t.renderTile(c)
+	return blob, err
+}
+
+// Like RenderTile, but also reports whether the tile has a single color.
+func (t *TileRenderer) renderTile(c TileCoord) ([]byte, bool, error) {
+	if t.err != nil {
+		return nil, false, t.err
+	}
 	c.setTMS(false)
-	return t.RenderTileZXY(c.Zoom, c.X, c.Y)
+	if err := t.m.ZoomToTile(c.Zoom, c.X, c.Y, 256, 128); err != nil {
+		return nil, false, err
+	}
+	return t.m.RenderToMemorySolid(t.Format)
 }
 
 // Render a tile with coordinates in Google tile format.
@@ -84,23 +193,16 @@ func (t *TileRenderer) RenderTile(c TileCoord) ([]byte, error) {
 // threads or setup multiple goroutinesand communicate with channels,
 // see NewTileRendererChan.
 func (t *TileRenderer) RenderTileZXY(zoom, x, y uint64) ([]byte, error) {
-	// Calculate pixel positions of bottom left & top right
-	p0 := [2]float64{float64(x) * 256, (float64(y) + 1) * 256}
-	p1 := [2]float64{(float64(x) + 1) * 256, float64(y) * 256}
-
-	// Convert to LatLong(EPSG:4326)
-	l0 := fromPixelToLL(p0, zoom)
-	l1 := fromPixelToLL(p1, zoom)
-
-	// Convert to map projection (e.g. mercartor co-ords EPSG:3857)
-	c0 := t.mp.Forward(mapnik.Coord{l0[0], l0[1]})
-	c1 := t.mp.Forward(mapnik.Coord{l1[0], l1[1]})
+	return t.RenderTile(TileCoord{X: x, Y: y, Zoom: zoom})
+}
 
-	// Bounding box for the Tile
-	t.m.Resize(256, 256)
-	t.m.ZoomToMinMax(c0.X, c0.Y, c1.X, c1.Y)
+// Render the block of n x n tiles with upper left tile x/y in a single pass,
+// see mapnik.Map.RenderMetatile. The tiles are returned in row-major order,
+// along with whether each of them has a single color.
+func (t *TileRenderer) RenderMetatileZXY(zoom, x, y uint64, n uint) ([][]byte, []bool, error) {
+	if t.err != nil {
+		return nil, nil, t.err
+	}
 	t.m.SetBufferSize(128)
-
-	blob, err := t.m.RenderToMemoryPng()
-	return blob, err
+	return t.m.RenderMetatile(zoom, x, y, n, t.Format)
 }
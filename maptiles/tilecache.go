@@ -0,0 +1,111 @@
+package maptiles
+
+import (
+	"container/list"
+	"sync"
+	"sync/atomic"
+)
+
+// Default size limit for the in-memory tile cache of a TileServer
+const DefaultTileCacheBytes = 64 << 20
+
+// In-memory LRU cache of encoded tiles, bounded by the total size of the
+// cached blobs. The cache is split into shards with their own lock and LRU
+// list so that concurrent requests rarely contend. Safe for concurrent use.
+type TileCache struct {
+	hits, misses uint64 // first in struct for 64-bit alignment of atomic ops
+	shards       []tileCacheShard
+}
+
+type tileCacheShard struct {
+	sync.Mutex
+	maxBytes int
+	bytes    int
+	lru      *list.List // front is most recently used
+	items    map[TileCoord]*list.Element
+}
+
+type tileCacheEntry struct {
+	key  TileCoord
+	blob []byte
+}
+
+// Creates a cache holding at most maxBytes of tile data spread over the
+// given number of shards.
+func NewTileCache(maxBytes, shards int) *TileCache {
+	if shards < 1 {
+		shards = 1
+	}
+	c := &TileCache{shards: make([]tileCacheShard, shards)}
+	for i := range c.shards {
+		c.shards[i].maxBytes = maxBytes / shards
+		c.shards[i].lru = list.New()
+		c.shards[i].items = make(map[TileCoord]*list.Element)
+	}
+	return c
+}
+
+func (c *TileCache) shard(key TileCoord) *tileCacheShard {
+	h := key.X*0x9e3779b97f4a7c15 ^ key.Y*0xc2b2ae3d27d4eb4f ^ key.Zoom
+	for i := 0; i < len(key.Layer); i++ {
+		h = (h ^ uint64(key.Layer[i])) * 0x100000001b3
+	}
+	h ^= h >> 29
+	return &c.shards[h%uint64(len(c.shards))]
+}
+
+func cacheKey(tc TileCoord) TileCoord {
+	tc.setTMS(false)
+	return tc
+}
+
+// Returns the cached tile or nil. The returned slice must not be modified.
+func (c *TileCache) Get(tc TileCoord) []byte {
+	key := cacheKey(tc)
+	s := c.shard(key)
+	s.Lock()
+	e, ok := s.items[key]
+	if !ok {
+		s.Unlock()
+		atomic.AddUint64(&c.misses, 1)
+		return nil
+	}
+	s.lru.MoveToFront(e)
+	blob := e.Value.(*tileCacheEntry).blob
+	s.Unlock()
+	atomic.AddUint64(&c.hits, 1)
+	return blob
+}
+
+// Adds a tile to the cache, evicting the least recently used tiles of its
+// shard as needed. Tiles larger than a shard are not cached.
+func (c *TileCache) Add(tc TileCoord, blob []byte) {
+	key := cacheKey(tc)
+	s := c.shard(key)
+	if len(blob) > s.maxBytes {
+		return
+	}
+	s.Lock()
+	defer s.Unlock()
+	if e, ok := s.items[key]; ok {
+		entry := e.Value.(*tileCacheEntry)
+		s.bytes += len(blob) - len(entry.blob)
+		entry.blob = blob
+		s.lru.MoveToFront(e)
+	} else {
+		s.items[key] = s.lru.PushFront(&tileCacheEntry{key, blob})
+		s.bytes += len(blob)
+	}
+	for s.bytes > s.maxBytes {
+		e := s.lru.Back()
+		entry := e.Value.(*tileCacheEntry)
+		s.lru.Remove(e)
+		delete(s.items, entry.key)
+		s.bytes -= len(entry.blob)
+	}
+}
+
+// Returns the number of cache hits and misses so far.
+func (c *TileCache) Stats() (hits, misses uint64) {
+	return atomic.LoadUint64(&c.hits), atomic.LoadUint64(&c.misses)
+}
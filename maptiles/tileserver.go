@@ -4,7 +4,11 @@ import (
 	"log"
 	"net/http"
 	"regexp"
+	"runtime"
 	"strconv"
+	"sync"
+	"sync/atomic"
+	"time"
 )
 
 // TODO serve list of registered layers per HTTP (preferably leafletjs-compatible js-array)
@@ -12,57 +16,169 @@ import (
 // Handles HTTP requests for map tiles, caching any produced tiles
 // in an MBtiles 1.2 compatible sqlite db.
 type TileServer struct {
+	// first in struct for 64-bit alignment of its atomic counters on 32-bit
+	// platforms
+	metrics serverMetrics
+
 	m         *TileDb
 	lmp       *LayerMultiplex
 	TmsSchema bool
+	// Render goroutines and queued render requests per layer, applied to
+	// layers added afterwards. Defaults to one worker per CPU.
+	RenderWorkers, RenderQueueSize int
+	// Collect render statistics for layers added afterwards, which feed the
+	// encode time histogram of the metrics. Adds a small overhead per
+	// feature, off by default.
+	RenderStats bool
+	// Recently served tiles, consulted before the cache db. May be set to
+	// nil to always go to the cache db.
+	MemCache *TileCache
+
+	formats map[string]string // tile file extension by layer, see formatExtension
+
+	mu       sync.Mutex
+	inflight map[TileCoord]*tileCall // renders in progress, by Google tile coordinates
+}
+
+// A tile render that concurrent requests for the same tile wait for
+type tileCall struct {
+	done   chan struct{}
+	result TileFetchResult
 }
 
 func NewTileServer(cacheFile string) *TileServer {
 	t := TileServer{}
 	t.lmp = NewLayerMultiplex()
 	t.m = NewTileDb(cacheFile)
+	t.inflight = make(map[TileCoord]*tileCall)
+	t.formats = make(map[string]string)
+	t.MemCache = NewTileCache(DefaultTileCacheBytes, 4*runtime.NumCPU())
+	t.RenderWorkers = runtime.NumCPU()
+	t.RenderQueueSize = 4 * t.RenderWorkers
 
 	return &t
 }
 
 func (t *TileServer) AddMapnikLayer(layerName string, stylesheet string) {
-	t.lmp.AddRenderer(layerName, stylesheet)
+	t.AddMapnikLayerFormat(layerName, stylesheet, DefaultFormat)
 }
 
-var pathRegex = regexp.MustCompile(`/([A-Za-z0-9]+)/([0-9]+)/([0-9]+)/([0-9]+)\.png`)
-
-func (t *TileServer) ServeTileRequest(w http.ResponseWriter, r *http.Request, tc TileCoord) {
-	ch := make(chan TileFetchResult)
+// Adds a layer whose tiles are encoded in the given Mapnik format string,
+// e.g. "png8:z=1" for cheap PNGs or "jpeg80" for raster layers.
+func (t *TileServer) AddMapnikLayerFormat(layerName, stylesheet, format string) {
+	t.lmp.Workers, t.lmp.QueueSize, t.lmp.RenderStats = t.RenderWorkers, t.RenderQueueSize, t.RenderStats
+	t.lmp.AddRendererFormat(layerName, stylesheet, format)
+	t.formats[layerName] = formatExtension(format)
+	if layerName == "default" {
+		// the MBTiles export of the cache db is the default layer
+		t.m.SetFormat(formatExtension(format))
+	}
+}
 
-	tr := TileFetchRequest{tc, ch}
-	t.m.RequestQueue() <- tr
+var pathRegex = regexp.MustCompile(`/([A-Za-z0-9]+)/([0-9]+)/([0-9]+)/([0-9]+)\.(png|jpe?g|webp)`)
 
-	result := <-ch
-	needsInsert := false
+func (t *TileServer) ServeTileRequest(w http.ResponseWriter, r *http.Request, tc TileCoord) {
+	atomic.AddUint64(&t.metrics.requests, 1)
+	result := TileFetchResult{Coord: tc}
+	if t.MemCache != nil {
+		result.BlobPNG = t.MemCache.Get(tc)
+	}
 
 	if result.BlobPNG == nil {
-		// Tile was not provided by DB, so submit the tile request to the renderer
-		t.lmp.SubmitRequest(tr)
+		start := time.Now()
+		ch := make(chan TileFetchResult)
+		t.m.RequestQueue() <- TileFetchRequest{tc, ch}
 		result = <-ch
-		if result.BlobPNG == nil {
-			// The tile could not be rendered, now we need to bail out.
-			http.NotFound(w, r)
-			return
+		t.metrics.fetch.observe(time.Since(start))
+
+		if result.BlobPNG != nil {
+			atomic.AddUint64(&t.metrics.dbHits, 1)
+		} else {
+			atomic.AddUint64(&t.metrics.dbMisses, 1)
+			// Tile was not provided by DB, so have it rendered
+			result = t.render(tc)
+			if result.BlobPNG == nil {
+				// The tile could not be rendered, now we need to bail out.
+				http.NotFound(w, r)
+				return
+			}
+		}
+		if t.MemCache != nil {
+			t.MemCache.Add(tc, result.BlobPNG)
 		}
-		needsInsert = true
 	}
 
-	w.Header().Set("Content-Type", "image/png")
-	_, err := w.Write(result.BlobPNG)
+	w.Header().Set("Content-Type", http.DetectContentType(result.BlobPNG))
+	n, err := w.Write(result.BlobPNG)
+	atomic.AddUint64(&t.metrics.bytesServed, uint64(n))
 	if err != nil {
 		log.Println(err)
 	}
-	if needsInsert {
-		t.m.InsertQueue() <- result // insert newly rendered tile into cache db
+}
+
+// Serves the server's counters and latency histograms in the Prometheus
+// text format. ServeHTTP answers requests for /metrics with it.
+func (t *TileServer) ServeMetrics(w http.ResponseWriter, r *http.Request) {
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	if err := t.writeMetrics(w); err != nil {
+		log.Println(err)
+	}
+}
+
+// Renders a tile that is missing from the cache db and queues it for
+// insertion. Concurrent misses of the same tile wait for a single render and
+// all receive its result.
+func (t *TileServer) render(tc TileCoord) TileFetchResult {
+	key := tc
+	key.setTMS(false)
+
+	t.mu.Lock()
+	if c, ok := t.inflight[key]; ok {
+		t.mu.Unlock()
+		<-c.done
+		result := c.result
+		result.Coord = tc
+		return result
+	}
+	c := &tileCall{done: make(chan struct{})}
+	t.inflight[key] = c
+	t.mu.Unlock()
+
+	start := time.Now()
+	ch := make(chan TileFetchResult)
+	if t.lmp.SubmitRequest(TileFetchRequest{tc, ch}) {
+		c.result = <-ch
+		t.metrics.observeRender(tc.Layer, time.Since(start), c.result)
+	} else {
+		c.result = TileFetchResult{Coord: tc}
+	}
+	close(c.done)
+
+	if c.result.BlobPNG == nil {
+		t.forget(key)
+		return c.result
 	}
+	// keep answering from the finished call until the tile can be fetched
+	// from the cache db, which is after its insert batch commits
+	r := c.result
+	r.Committed = func() { t.forget(key) }
+	go func() {
+		t.m.InsertQueue() <- r
+	}()
+	return c.result
+}
+
+func (t *TileServer) forget(key TileCoord) {
+	t.mu.Lock()
+	delete(t.inflight, key)
+	t.mu.Unlock()
 }
 
 func (t *TileServer) ServeHTTP(w http.ResponseWriter, r *http.Request) {
+	if r.URL.Path == "/metrics" {
+		t.ServeMetrics(w, r)
+		return
+	}
 	path := pathRegex.FindStringSubmatch(r.URL.Path)
 
 	if path == nil {
@@ -71,6 +187,15 @@ func (t *TileServer) ServeHTTP(w http.ResponseWriter, r *http.Request) {
 	}
 
 	l := path[1]
+	ext := path[5]
+	if ext == "jpeg" {
+		ext = "jpg"
+	}
+	if f, ok := t.formats[l]; ok && f != ext {
+		// layers are encoded in a single format, see AddMapnikLayerFormat
+		http.NotFound(w, r)
+		return
+	}
 	z, _ := strconv.ParseUint(path[2], 10, 64)
 	x, _ := strconv.ParseUint(path[3], 10, 64)
 	y, _ := strconv.ParseUint(path[4], 10, 64)